@@ -224,6 +224,10 @@ void Host_SetWindowBackground(SDL_Surface *s) {
 	SDL_BlitSurface(s, 0, g_background, 0);
 }
 
+uint32_t Host_GetTimerUs() {
+	return SDL_GetPerformanceCounter() * 1000000 / SDL_GetPerformanceFrequency();
+}
+
 uint32_t Host_GetTimer() {
 	if (0) {
 		return SDL_GetPerformanceCounter() * 1000 / SDL_GetPerformanceFrequency();
@@ -62,6 +62,7 @@ void Host_BlankWindow();
 void Host_SetWindowBackground(SDL_Surface *s);
 
 uint32_t Host_GetTimer();
+uint32_t Host_GetTimerUs();
 
 int Host_GetLeftClick();
 int Host_GetRightClick();
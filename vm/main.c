@@ -165,6 +165,13 @@ static void ParseGameIni() {
 int main(int argc, char *argv[]) {
 	g_debugMask = DBG_INFO;
 	char *dataPath = 0;
+	int gcBudget = 0;
+	int jitThreshold = 0;
+	int jitCheck = 0;
+	const char *aotPath = 0;
+	const char *aotOutput = 0;
+	const char *sobPath = 0;
+	const char *optimizeOutput = 0;
 	if (argc == 2) {
 		// data path as the only command line argument
 		struct stat st;
@@ -176,6 +183,13 @@ int main(int argc, char *argv[]) {
 			static struct option options[] = {
 				{ "datapath",   required_argument, 0, 1 },
 				{ "debug",      required_argument, 0, 2 },
+				{ "gc-budget",  required_argument, 0, 3 },
+				{ "jit",        optional_argument, 0, 4 },
+				{ "jit-check",  no_argument,       0, 5 },
+				{ "aot",        required_argument, 0, 6 },
+				{ "aot-output", required_argument, 0, 7 },
+				{ "sob-path",   required_argument, 0, 8 },
+				{ "optimize-output", required_argument, 0, 9 },
 				{ 0, 0, 0, 0 },
 			};
 			int index;
@@ -190,6 +204,27 @@ int main(int argc, char *argv[]) {
 			case 2:
 				g_debugMask = DBG_INFO | atoi(optarg);
 				break;
+			case 3:
+				gcBudget = atoi(optarg);
+				break;
+			case 4:
+				jitThreshold = optarg ? atoi(optarg) : VMJIT_THRESHOLD;
+				break;
+			case 5:
+				jitCheck = 1;
+				break;
+			case 6:
+				aotPath = strdup(optarg);
+				break;
+			case 7:
+				aotOutput = strdup(optarg);
+				break;
+			case 8:
+				sobPath = strdup(optarg);
+				break;
+			case 9:
+				optimizeOutput = strdup(optarg);
+				break;
                         }
 		}
 	}
@@ -213,6 +248,9 @@ int main(int argc, char *argv[]) {
 			}
 			Pan_InitShuffleTable(gameName);
 			Pan_InitHeap(PAN_HEAP_SIZE);
+			if (sobPath) {
+				Pan_SetOverridePath(sobPath);
+			}
 			ParseGameIni();
 			VMContext *c = VM_NewContext();
 			if (version) {
@@ -220,13 +258,27 @@ int main(int argc, char *argv[]) {
 				VM_SetGameID(c, version->gid);
 			}
 			c->get_timer = Host_GetTimer;
+			c->get_timer_us = Host_GetTimerUs;
+			c->gc_budget_us = gcBudget;
+			if (jitThreshold > 0 || jitCheck) {
+				c->jit = VM_NewJit(jitThreshold > 0 ? jitThreshold : VMJIT_THRESHOLD, jitCheck);
+			}
+			if (aotPath) {
+				c->aot = VM_LoadAot(aotPath);
+			}
 			VM_InitOpcodes();
 			VM_InitSyscalls(c);
 			Fio_Init(dataPath, ".");
-			Host_Init(version ? version->name : "", _windowW, _windowH);
-			VM_RunMainBoot(c, _bootClass ? _bootClass : gameName, "");
-			Host_MainLoop(50, (UpdateProc)VM_RunThreads, c);
-			Host_Fini();
+			if (aotOutput) {
+				VM_WriteAot(c, aotOutput);
+			} else if (optimizeOutput) {
+				VM_WriteOptimizedClasses(c, optimizeOutput);
+			} else {
+				Host_Init(version ? version->name : "", _windowW, _windowH);
+				VM_RunMainBoot(c, _bootClass ? _bootClass : gameName, "");
+				Host_MainLoop(50, (UpdateProc)VM_RunThreads, c);
+				Host_Fini();
+			}
 			VM_FreeContext(c);
 			SDL_Quit();
 		}
@@ -43,6 +43,7 @@ void Pan_InitShuffleTable(const char *name) {
 
 typedef struct heap_asset_t {
 	uint8_t *buffer;
+	int size;
 	int ref_count;
 } HeapAsset;
 
@@ -54,6 +55,7 @@ static int _assetsCount;
 static FILE *_files[PAN_FILES_COUNT];
 static int _filesCount;
 static int _assetsHeapSize;
+static const char *_overridePath; /* files replacing the assets, eg. the optimised classes */
 
 static const int _dumpAssets = false;
 
@@ -244,6 +246,18 @@ int Pan_GetAssetType(uint32_t id) {
 	return -1;
 }
 
+void Pan_SetOverridePath(const char *path) {
+	_overridePath = path;
+}
+
+int Pan_GetAssetsCount() {
+	return _assetsCount;
+}
+
+const PanAsset *Pan_GetAsset(int index) {
+	return &_assets[index];
+}
+
 static uint8_t *loadFromPan(const PanAsset *asset) {
 	FILE *fp = _files[asset->f];
 	fseek(fp, asset->offset, SEEK_SET);
@@ -263,22 +277,52 @@ static uint8_t *loadFromPan(const PanAsset *asset) {
 	return buffer;
 }
 
+static uint8_t *loadFromFile(const PanAsset *asset, int *size) {
+	char path[MAXPATHLEN];
+	snprintf(path, sizeof(path), "%s/%s", _overridePath, asset->name);
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *buffer = (uint8_t *)malloc(*size);
+	if (!buffer) {
+		error("Failed to allocate %d bytes", *size);
+	} else {
+		const int count = fread(buffer, 1, *size, fp);
+		if (count != *size) {
+			error("Failed to read %d bytes, ret %d", *size, count);
+		}
+	}
+	fclose(fp);
+	debug(DBG_PAN, "Loaded asset '%s' from '%s'", asset->name, path);
+	return buffer;
+}
+
 static int load(const PanAsset *asset, PanBuffer *pb) {
 	const int x = asset - _assets;
 	HeapAsset *ha = &_heapAssets[x];
 	if (ha->ref_count == 0) {
 		assert(!ha->buffer);
-		ha->buffer = loadFromPan(asset);
-		_assetsHeapSize += asset->size;
+		if (_overridePath && asset->name) {
+			ha->buffer = loadFromFile(asset, &ha->size);
+		}
+		if (!ha->buffer) {
+			ha->buffer = loadFromPan(asset);
+			ha->size = asset->size;
+		}
+		_assetsHeapSize += ha->size;
 		debug(DBG_PAN, "Loaded asset:%d heapSize:%d", asset->id, _assetsHeapSize);
 		if (_dumpAssets) {
 			char path[MAXPATHLEN];
 			snprintf(path, sizeof(path), "DUMPS/%d.bin", asset->id);
 			FILE *fp = fopen(path, "wb");
 			if (fp) {
-				const int count = fwrite(ha->buffer, 1, asset->size, fp);
-				if (count != asset->size) {
-					error("Failed to write %d bytes (%d)", asset->size, count);
+				const int count = fwrite(ha->buffer, 1, ha->size, fp);
+				if (count != ha->size) {
+					error("Failed to write %d bytes (%d)", ha->size, count);
 				}
 				fclose(fp);
 			}
@@ -286,11 +330,11 @@ static int load(const PanAsset *asset, PanBuffer *pb) {
 	}
 	if (pb) {
 		pb->buffer = ha->buffer;
-		pb->size = asset->size;
+		pb->size = ha->size;
 		pb->index = x;
 	}
 	++ha->ref_count;
-	return asset->size;
+	return ha->size;
 }
 
 static void unload(PanBuffer *pb) {
@@ -301,7 +345,7 @@ static void unload(PanBuffer *pb) {
 		free(ha->buffer);
 		ha->buffer = 0;
 		const PanAsset *asset = &_assets[pb->index];
-		_assetsHeapSize -= asset->size;
+		_assetsHeapSize -= ha->size;
 		debug(DBG_PAN, "Unloaded asset:%d heapSize:%d", asset->id, _assetsHeapSize);
 		memset(pb, 0, sizeof(PanBuffer));
 	}
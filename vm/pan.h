@@ -36,6 +36,9 @@ int Pan_Open(const char *filePath, uint32_t offset);
 int Gg_Open(const char *filePath);
 int Pan_HasAsset(uint32_t id);
 int Pan_GetAssetType(uint32_t id);
+void Pan_SetOverridePath(const char *path);
+int Pan_GetAssetsCount();
+const PanAsset *Pan_GetAsset(int index);
 int Pan_LoadAssetById(uint32_t id, PanBuffer *buffer);
 int Pan_LoadAssetByName(const char *name, PanBuffer *buffer);
 void Pan_UnloadAsset(PanBuffer *buffer);
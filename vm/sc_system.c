@@ -17,7 +17,7 @@ static void fn_system_gc(VMContext *c) {
 	const int counter = VM_PopInt32(c);
 	debug(DBG_SYSCALLS, "System:gc counter:%d", counter);
 	if (counter == -1) { /* NOW */
-		VM_GC(1);
+		VM_GC(c, 1);
 	} else {
 		c->gc_counter = counter;
 	}
@@ -4,6 +4,60 @@
 
 static const uint32_t SEP_TAG = 0xabcdabcd;
 
+static uint32_t hashSymbol(int type, const char *s) {
+	uint32_t hash = 2166136261u ^ type; /* FNV-1a */
+	while (*s) {
+		hash ^= (uint8_t)*s++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* open addressing index of the class methods, members and statics names */
+static void buildSymbols(SobData *sob) {
+	int size = 16;
+	while (size < sob->refentries_count * 2) {
+		size <<= 1;
+	}
+	sob->symbols_mask = size - 1;
+	sob->symbols_data = (uint32_t *)calloc(size, sizeof(uint32_t));
+	if (!sob->symbols_data) {
+		error("Failed to allocate %d SobData.symbols", size);
+	}
+	for (int i = 1; i <= sob->refentries_count; ++i) {
+		const SobRefEntry *ref = &sob->refentries_data[i];
+		if (ref->class_index != 1 || ref->name_index == 0 || ref->name_index > sob->stringentries_count) {
+			continue;
+		}
+		switch (ref->type) {
+		case SOB_REFERENCE_TYPE_METHOD:
+		case SOB_REFERENCE_TYPE_MEMBER:
+		case SOB_REFERENCE_TYPE_STATIC:
+			break;
+		default:
+			continue;
+		}
+		uint32_t pos = hashSymbol(ref->type, Sob_GetString(sob, ref->name_index));
+		while (sob->symbols_data[pos & sob->symbols_mask] != 0) {
+			++pos;
+		}
+		sob->symbols_data[pos & sob->symbols_mask] = i;
+	}
+}
+
+static int findSymbol(SobData *sob, int type, const char *s) {
+	uint32_t pos = hashSymbol(type, s);
+	int num;
+	while ((num = sob->symbols_data[pos & sob->symbols_mask]) != 0) {
+		const SobRefEntry *ref = &sob->refentries_data[num];
+		if (ref->type == type && strcmp(s, Sob_GetString(sob, ref->name_index)) == 0) {
+			return num;
+		}
+		++pos;
+	}
+	return 0;
+}
+
 SobData *LoadSob(const uint8_t *data, int size, int *offset, const char *filename) {
 	SobData *sob = (SobData *)calloc(1, sizeof(SobData));
 	if (!sob) {
@@ -181,6 +235,8 @@ SobData *LoadSob(const uint8_t *data, int size, int *offset, const char *filenam
 			sep = Read32(data, size, offset);
 			if (sep != SEP_TAG) error("12Bad file format in %s", filename);
 		}
+
+		buildSymbols(sob);
 	}
 	return sob;
 }
@@ -191,59 +247,114 @@ void UnloadSob(SobData *sob) {
 		free(sob->autoload_data);
 		free(sob->default_membervars_data);
 		free(sob->staticvars_data);
+		for (int i = 1; i <= sob->codeentries_count; ++i) {
+			free(sob->codeentries_data[i].locals_data);
+		}
 		free(sob->codeentries_data);
 		free(sob->local_data);
 		free(sob->refentries_data);
 		free(sob->stringentries_data);
 		free(sob->strings_data);
 		free(sob->code_data);
+		free(sob->symbols_data);
+		free(sob->vtable);
+		free(sob->ref_slots);
+		free(sob->insns);
+		free(sob->jit_entries);
+		for (int i = 0; i < sob->caches_count; ++i) {
+			free(sob->caches_data[i]);
+		}
+		free(sob->caches_data);
 		free(sob);
 	}
 }
 
+/* sections in the layout read by LoadSob. The header and the last word of
+ * the references, skipped when loading, are written as 0. */
+void Sob_Write(const SobData *sob, FILE *fp) {
+	fileWrite32LE(fp, SEP_TAG);
+	for (int i = 0; i < 5; ++i) {
+		fileWrite32LE(fp, 0);
+	}
+	fileWrite32LE(fp, sob->frameworks_count);
+	for (int i = 0; i < sob->frameworks_count; ++i) {
+		fileWrite32LE(fp, sob->frameworks_data[i]);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->autoload_count);
+	for (int i = 0; i < sob->autoload_count; ++i) {
+		fileWrite32LE(fp, sob->autoload_data[i]);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->default_membervars_count);
+	for (int i = 0; i < sob->default_membervars_count; ++i) {
+		fileWrite32LE(fp, sob->default_membervars_data[i + 1].type);
+		fileWrite32LE(fp, sob->default_membervars_data[i + 1].value);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->staticvars_count);
+	for (int i = 0; i < sob->staticvars_count; ++i) {
+		fileWrite32LE(fp, sob->staticvars_data[i + 1].type);
+		fileWrite32LE(fp, sob->staticvars_data[i + 1].value);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->codeentries_count);
+	for (int i = 0; i < sob->codeentries_count; ++i) {
+		fileWrite32LE(fp, sob->codeentries_data[i + 1].code_offset);
+		fileWrite32LE(fp, sob->codeentries_data[i + 1].locals_offset);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->local_count);
+	fileWrite(fp, sob->local_data, sob->local_count);
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->refentries_count);
+	for (int i = 0; i < sob->refentries_count; ++i) {
+		const SobRefEntry *ref = &sob->refentries_data[i + 1];
+		fileWrite32LE(fp, ref->type);
+		fileWrite32LE(fp, ref->flags);
+		fileWrite32LE(fp, ref->class_index);
+		fileWrite32LE(fp, ref->name_index);
+		fileWrite32LE(fp, ref->member_index);
+		fileWrite32LE(fp, ref->data_index);
+		fileWrite32LE(fp, 0);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->stringentries_count);
+	for (int i = 0; i < sob->stringentries_count; ++i) {
+		fileWrite32LE(fp, sob->stringentries_data[i + 1]);
+	}
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->strings_size);
+	fileWrite(fp, sob->strings_data, sob->strings_size);
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, sob->code_size);
+	fileWrite(fp, sob->code_data, sob->code_size);
+	fileWrite32LE(fp, SEP_TAG);
+	fileWrite32LE(fp, SEP_TAG);
+}
+
 int Sob_FindMember(SobData *sob, const char *s) {
-	for (int i = 1; i <= sob->refentries_count; ++i) {
-		const SobRefEntry *ref = &sob->refentries_data[i];
-		if (ref->class_index == 1 && ref->type == SOB_REFERENCE_TYPE_MEMBER) {
-			const int x = ref->name_index;
-			const char *name = Sob_GetString(sob, x);
-			if (strcmp(s, name) == 0) {
-				debug(DBG_SOB, "Found member '%s' index %d", name, i);
-				return i;
-			}
-		}
+	const int num = findSymbol(sob, SOB_REFERENCE_TYPE_MEMBER, s);
+	if (num != 0) {
+		debug(DBG_SOB, "Found member '%s' index %d", s, num);
 	}
-	return 0;
+	return num;
 }
 
 int Sob_FindMethod(SobData *sob, const char *s) {
-	for (int i = 1; i <= sob->refentries_count; ++i) {
-		const SobRefEntry *ref = &sob->refentries_data[i];
-		if (ref->class_index == 1 && ref->type == SOB_REFERENCE_TYPE_METHOD) {
-			const int x = ref->name_index;
-			const char *name = Sob_GetString(sob, x);
-			if (strcmp(s, name) == 0) {
-				debug(DBG_SOB, "Found method '%s' index %d", name, i);
-				return i;
-			}
-		}
+	const int num = findSymbol(sob, SOB_REFERENCE_TYPE_METHOD, s);
+	if (num != 0) {
+		debug(DBG_SOB, "Found method '%s' index %d", s, num);
 	}
-	return 0;
+	return num;
 }
 
 int Sob_FindStatic(SobData *sob, const char *s) {
-	for (int i = 1; i <= sob->refentries_count; ++i) {
-		const SobRefEntry *ref = &sob->refentries_data[i];
-		if (ref->class_index == 1 && ref->type == SOB_REFERENCE_TYPE_STATIC) {
-			const int x = ref->name_index;
-			const char *name = Sob_GetString(sob, x);
-			if (strcmp(s, name) == 0) {
-				debug(DBG_SOB, "Found static '%s' index %d", name, i);
-				return i;
-			}
-		}
+	const int num = findSymbol(sob, SOB_REFERENCE_TYPE_STATIC, s);
+	if (num != 0) {
+		debug(DBG_SOB, "Found static '%s' index %d", s, num);
 	}
-	return 0;
+	return num;
 }
 
 SobRefEntry *Sob_GetRefClass(SobData *sob, int num) {
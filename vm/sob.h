@@ -4,6 +4,8 @@
 
 #include "intern.h"
 
+struct vminsn_t;
+
 typedef struct {
 	int type;
 	int value;
@@ -16,6 +18,10 @@ typedef struct {
 	uint32_t code_offset;
 	int32_t class_handle;
 	// uint32_t unk14;
+	int locals_count;
+	int args_count;
+	SobVar *locals_data;
+	int calls_count; /* compiled by the JIT past the threshold */
 } SobCodeEntry;
 
 enum {
@@ -26,6 +32,13 @@ enum {
 	SOB_REFERENCE_TYPE_ENUM   = 6,
 };
 
+/* the parent class slots come first, at the same index in the subclasses */
+typedef struct {
+	const char *name; /* 0 if the method is not declared by the class */
+	int method_num;
+	SobCodeEntry *code;
+} SobMethodSlot;
+
 typedef struct {
 	uint32_t type;
 	uint32_t flags;
@@ -46,7 +59,8 @@ typedef struct {
 	int autoload_count;
 	uint32_t *autoload_data;
 	int default_membervars_count;
-	SobVar *default_membervars_data;
+	SobVar *default_membervars_data; /* objects members template, type checked in fixUp */
+	void *members_free; /* deleted objects members blocks, linked with the member 0 */
 	int staticvars_count;
 	SobVar *staticvars_data;
 	int codeentries_count;
@@ -61,11 +75,23 @@ typedef struct {
 	uint8_t *strings_data;
 	int code_size;
 	uint8_t *code_data;
+	uint32_t symbols_mask;
+	uint32_t *symbols_data;
+	int vtable_count;
+	SobMethodSlot *vtable;
+	int *ref_slots; /* vtable slot of the method references, -1 if unknown */
+	int new_method, delete_method;
+	struct vminsn_t *insns;
+	void **jit_entries; /* native code by offset, 0 if not compiled */
+	const void *aot; /* translated class, 0 if interpreted */
+	int caches_count;
+	void **caches_data;
 	uint8_t fixup_flag;
 } SobData;
 
 SobData *LoadSob(const uint8_t *data, int size, int *offset, const char *filename);
 void UnloadSob(SobData *sob);
+void Sob_Write(const SobData *sob, FILE *fp);
 
 int Sob_FindMember(SobData *sob, const char *name);
 int Sob_FindMethod(SobData *sob, const char *name);
@@ -61,3 +61,16 @@ uint32_t fileRead32LE(FILE *fp) {
 	fileRead(fp, buf, 4);
 	return READ_LE_UINT32(buf);
 }
+
+void fileWrite(FILE *fp, const void *buf, int size) {
+	const int count = fwrite(buf, 1, size, fp);
+	if (count != size) {
+		error("I/O error on writing %d bytes, ret %d", size, count);
+	}
+}
+
+void fileWrite32LE(FILE *fp, uint32_t value) {
+	uint8_t buf[4];
+	WRITE_LE_UINT32(buf, value);
+	fileWrite(fp, buf, 4);
+}
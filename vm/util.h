@@ -17,6 +17,8 @@ enum {
 	DBG_SYSCALLS = 1 << 9,
 	DBG_FILEIO   = 1 << 10,
 	DBG_MIXER    = 1 << 11,
+	DBG_GC       = 1 << 12,
+	DBG_HEAP     = 1 << 13,
 };
 
 extern uint32_t g_debugMask;
@@ -27,6 +29,8 @@ void warning(const char *msg, ...);
 
 uint16_t fileRead16LE(FILE *fp);
 uint32_t fileRead32LE(FILE *fp);
+void fileWrite(FILE *fp, const void *buf, int size);
+void fileWrite32LE(FILE *fp, uint32_t value);
 
 static inline uint16_t Read16(const uint8_t *buffer, int size, int *pos) {
 	if (*pos + sizeof(uint16_t) > size) {
@@ -27,21 +27,13 @@ VMContext *VM_NewContext() {
 	VMContext *c = (VMContext *)calloc(1, sizeof(VMContext));
 	if (c) {
 		c->classes_count = 1; /* null class 0 */
-		c->arrays_next_free = 1;
-		for (int i = 1; i < VMARRAYS_COUNT - 1; ++i) {
-			c->arrays[i].next_free = i + 1;
-		}
-		c->objects_next_free = 1;
-		for (int i = 1; i < VMOBJECTS_COUNT - 1; ++i) {
-			c->objects[i].next_free = i + 1;
-		}
-		c->threads_next_free = 1;
-		for (int i = 1; i < VMTHREADS_COUNT - 1; ++i) {
-			c->threads[i].next_free = i + 1;
-		}
-		c->thread_handle_counter = BASE_HANDLE_THREAD;
 		c->gameID = -1; /* to handle bytecode and syscalls differences */
-		c->thread_handle_counter = BASE_HANDLE_THREAD;
+		c->heap = VM_NewHeap();
+		c->class_names_size = VMCLASSNAMES_SIZE;
+		c->class_names = (VMClassName *)calloc(c->class_names_size, sizeof(VMClassName));
+		if (!c->class_names) {
+			error("Failed to allocate %d class names", c->class_names_size);
+		}
 		for (int i = 0; _COLORS[i].name; ++i) {
 			VM_DefineInt(c, _COLORS[i].name, _COLORS[i].value);
 		}
@@ -50,6 +42,35 @@ VMContext *VM_NewContext() {
 }
 
 void VM_FreeContext(VMContext *c) {
+	for (int i = 0; i < c->class_names_size; ++i) {
+		const VMClassName *cn = &c->class_names[i];
+		if (cn->name && cn->handle == 0) {
+			free((char *)cn->name);
+		}
+	}
+	free(c->class_names);
+	/* the arrays data and objects members are released with the heap */
+	for (int i = 0; i < c->arrays_capacity / VMPOOL_CHUNK_SIZE; ++i) {
+		free(c->arrays[i]);
+	}
+	for (int i = 0; i < c->objects_capacity / VMPOOL_CHUNK_SIZE; ++i) {
+		free(c->objects[i]);
+	}
+	VM_DumpHeapStats(c->heap);
+	VM_DumpOpcodesProfile();
+	VM_FreeHeap(c->heap);
+	VM_FreeJit(c->jit);
+	VM_FreeAot(c->aot);
+	for (int i = 0; i < c->threads_capacity / VMPOOL_CHUNK_SIZE; ++i) {
+		VMScript *scripts = c->scripts[i];
+		for (int j = 0; j < VMPOOL_CHUNK_SIZE; ++j) {
+			free(scripts[j].local_vars);
+		}
+		free(scripts);
+		free(c->threads[i]);
+	}
+	free(c->frames);
+	free(c->gc);
 	free(c);
 }
 
@@ -144,39 +165,93 @@ int VM_InvokeStaticMethod(VMContext *c, const char *class_name, const char *stat
 	return VM_InvokeMethod(c, sob, method_num, 0, 1, 1, 0);
 }
 
-static VMScript *prepareCall(VMContext *c, VMScript *script, int class_handle, int obj_handle, int code_num) {
-	debug(DBG_VM, "prepareCall c:%p script:%p class_handle:%d obj_handle:%d", c, script, class_handle, obj_handle);
+static SobCodeEntry *getMethodCode(VMContext *c, int class_handle, int code_num) {
 	SobData *sob = ClassHandle_GetSob(c, class_handle);
 	SobCodeEntry *code = Sob_GetCode(sob, code_num);
 	if (code->class_handle == -1) {
 		error("Code entry %d in class %d not fixed up correctly", code_num, class_handle);
 	}
+	return code;
+}
 
-	assert(code->locals_ptr);
-	int32_t locals_size = READ_LE_UINT32(code->locals_ptr);
-	int32_t args_count = READ_LE_UINT32(code->locals_ptr + 4);
-	debug(DBG_VM, "locals_size:%d args_count:%d", locals_size, args_count);
-	if (locals_size < 0 || args_count < 0 || args_count > locals_size || locals_size > 10000) {
-		error("localCount (%d) out of range (%d..%d)", locals_size, 0, 10000);
-	}
-	++locals_size;
-	script->local_vars_count = locals_size;
-	script->local_vars = (VMVar *)calloc(locals_size, sizeof(VMVar));
-	if (!script->local_vars) {
-		error("Failed to allocate %d localVars", locals_size);
-	} else {
+/* locals types of the method, SobVar and VMVar have the same layout */
+const SobVar *VM_GetLocalsTemplate(SobCodeEntry *code) {
+	if (!code->locals_data) {
+		assert(code->locals_ptr);
+		int32_t locals_size = READ_LE_UINT32(code->locals_ptr);
+		int32_t args_count = READ_LE_UINT32(code->locals_ptr + 4);
+		debug(DBG_VM, "locals_size:%d args_count:%d", locals_size, args_count);
+		if (locals_size < 0 || args_count < 0 || args_count > locals_size || locals_size > 10000) {
+			error("localCount (%d) out of range (%d..%d)", locals_size, 0, 10000);
+		}
+		++locals_size;
+		SobVar *vars = (SobVar *)calloc(locals_size, sizeof(SobVar));
+		if (!vars) {
+			error("Failed to allocate %d localVars", locals_size);
+		}
 		int offset = 8;
 		for (int i = 1; i < locals_size; ++i) {
-			script->local_vars[i].type = READ_LE_UINT32(code->locals_ptr + offset); offset += 4;
-			script->local_vars[i].value = 0;
+			vars[i].type = READ_LE_UINT32(code->locals_ptr + offset); offset += 4;
+		}
+		vars[0].type = VAR_TYPE_OBJECT;
+		code->locals_count = locals_size;
+		code->args_count = args_count;
+		code->locals_data = vars;
+	}
+	return code->locals_data;
+}
+
+static VMVar *allocFrame(VMContext *c, int count) {
+	if (!c->frames) {
+		c->frames = (VMVar *)malloc(VMFRAMES_SIZE * sizeof(VMVar));
+		if (!c->frames) {
+			error("Failed to allocate %d frame stack vars", VMFRAMES_SIZE);
 		}
-		script->local_vars[0].type = VAR_TYPE_OBJECT;
-		script->local_vars[0].value = obj_handle;
 	}
+	if (c->frames_top + count > VMFRAMES_SIZE) {
+		return 0;
+	}
+	VMVar *vars = c->frames + c->frames_top;
+	c->frames_top += count;
+	return vars;
+}
+
+static VMScript *prepareCall(VMContext *c, VMScript *script, SobCodeEntry *code, int obj_handle, int locals_alloc) {
+	debug(DBG_VM, "prepareCall c:%p script:%p class_handle:%d obj_handle:%d", c, script, code->class_handle, obj_handle);
+	const SobVar *locals = VM_GetLocalsTemplate(code);
+	const int locals_size = code->locals_count;
+	VMVar *vars = 0;
+	if (locals_alloc == SCRIPT_LOCALS_FRAME) {
+		vars = allocFrame(c, locals_size);
+		if (!vars) {
+			locals_alloc = SCRIPT_LOCALS_HEAP;
+		}
+	} else if (locals_alloc == SCRIPT_LOCALS_POOL) {
+		if (script->locals_capacity < locals_size) {
+			free(script->local_vars);
+			script->local_vars = 0;
+			script->locals_capacity = 0;
+		}
+		vars = script->local_vars;
+	}
+	if (!vars) {
+		vars = (VMVar *)malloc(locals_size * sizeof(VMVar));
+		if (!vars) {
+			error("Failed to allocate %d localVars", locals_size);
+		}
+		if (locals_alloc == SCRIPT_LOCALS_POOL) {
+			script->locals_capacity = locals_size;
+		}
+	}
+	script->locals_alloc = locals_alloc;
+	memcpy(vars, locals, locals_size * sizeof(VMVar));
+	vars[0].value = obj_handle;
+	script->local_vars_count = locals_size;
+	script->local_vars = vars;
 
 	script->obj_handle = obj_handle;
 
-	for (; args_count >= 1; --args_count) {
+	for (int args_count = code->args_count; args_count >= 1; --args_count) {
 		VMVar st = VM_Pop2(c);
 		VMVar *var = &script->local_vars[args_count];
 		VM_CheckVarType(var->type);
@@ -185,8 +260,10 @@ static VMScript *prepareCall(VMContext *c, VMScript *script, int class_handle, i
 	}
 
 	script->code_offset = code->code_offset;
-	script->code_data = code->code_ptr;
 	script->class_handle = code->class_handle;
+	if (c->jit) {
+		VM_JitCountCall(c, code);
+	}
 	// script->unk14 = code->unk14;
 	script->next_script = 0;
 
@@ -195,8 +272,10 @@ static VMScript *prepareCall(VMContext *c, VMScript *script, int class_handle, i
 
 static void endCall(VMContext *c, VMScript *script) {
 	debug(DBG_VM, "endCall c:%p script:%p", c, script);
-	free(script->local_vars);
-	script->local_vars = 0;
+	if (script->locals_alloc == SCRIPT_LOCALS_HEAP) {
+		free(script->local_vars);
+		script->local_vars = 0;
+	}
 	VMScript *next = script->next_script;
 	if (next) {
 		endCall(c, next);
@@ -218,41 +297,31 @@ static int executeMethod(VMContext *c, VMScript *script, VMThread *thread, int f
 	script->sob_data = ClassHandle_GetSob(c, script->class_handle);
 	VMScript *prev_script = c->script;
 	c->script = script;
-	const uint8_t *prev_code = c->code;
-	c->code = script->code_offset + script->code_data;
+	SobData *sob = script->sob_data;
+	if (script->code_offset >= sob->code_size) {
+		error("Code offset %d out of range (%d) in class '%s'", script->code_offset, sob->code_size, sob->class_name);
+	}
+	if (!sob->insns || sob->insns[script->code_offset].len == 0) {
+		Insn_DecodeAt(c, sob, script->code_offset);
+	}
+	VMInsn *prev_code = c->code;
+	c->code = sob->insns + script->code_offset;
 	script->state = 0;
-	while (1) {
-		const uint8_t op = *c->code++;
-		++script->code_offset;
-		VM_ExecuteOpcode(c, op);
-		if (script->state != 0) {
-			break;
-		}
-		if (script->thread->state == SCRIPT_STATE_RUNNING) {
-			continue;
-		}
-		if (script->state == 0) {
-			script->state = script->thread->state;
-		}
-		break;
+	if (!VM_AotExecute(c, script) && (!c->jit || !VM_JitExecute(c, script))) {
+		VM_Execute(c, script);
 	}
-	script->code_offset = c->code - script->code_data;
+	script->code_offset = c->code - sob->insns;
 	c->code = prev_code;
 	c->script = prev_script;
 	return script->state;
 }
 
-static int startMethod(VMContext *c, int class_handle, int obj_handle, int code_num) {
+static int startMethod(VMContext *c, SobCodeEntry *code, int obj_handle) {
 	VMThread *thread = Thread_New(c);
 	Thread_Start(thread);
 
-	VMScript *script = (VMScript *)calloc(1, sizeof(VMScript));
-	if (!script) {
-		error("Failed to allocate VMScript");
-	}
-	VMScript *current = prepareCall(c, script, class_handle, obj_handle, code_num);
-
-	thread->script = current;
+	VMScript *script = thread->script;
+	prepareCall(c, script, code, obj_handle, SCRIPT_LOCALS_POOL);
 	VM_AddThread(c, thread);
 
 	thread->unk1C = 1;
@@ -273,19 +342,17 @@ int VM_StartMethod(VMContext *c, int obj_handle, const char *name) {
 	if (num != 0) {
 		const SobRefEntry *ref = Sob_GetRefMethod(sob, num);
 		if (ref->data_index != 0) {
-			startMethod(c, obj->class_handle, obj_handle, ref->data_index);
+			startMethod(c, getMethodCode(c, obj->class_handle, ref->data_index), obj_handle);
 			return 1;
 		}
 	}
 	return 0;
 }
 
-static int callMethod(VMContext *c, VMScript *parent, int class_handle, int obj_handle, int code_num) {
-	if (c->gc_counter == -2) { /* AGGRESSIVE */
-		VM_GC(0);
-	}
+static int callMethod(VMContext *c, VMScript *parent, SobCodeEntry *code, int obj_handle) {
+	const int frames_top = c->frames_top;
 	VMScript script;
-	prepareCall(c, &script, class_handle, obj_handle, code_num);
+	prepareCall(c, &script, code, obj_handle, SCRIPT_LOCALS_FRAME);
 	++c->method_call_depth;
 	if (c->method_call_depth > 500) {
 		error("Method calls nested too deep");
@@ -294,6 +361,9 @@ static int callMethod(VMContext *c, VMScript *parent, int class_handle, int obj_
 		error("m_next not NULL (Internal error)");
 	}
 	parent->next_script = &script;
+	if (c->gc_counter == -2) { /* AGGRESSIVE, after the arguments are moved to the locals */
+		VM_GC(c, 0);
+	}
 	const int ret = executeMethod(c, &script, parent->thread, 1);
 	if (ret == SCRIPT_STATE_YIELD) {
 		error("Non script method did a breakhere");
@@ -301,31 +371,34 @@ static int callMethod(VMContext *c, VMScript *parent, int class_handle, int obj_
 	parent->next_script = 0;
 	--c->method_call_depth;
 	endCall(c, &script);
+	c->frames_top = frames_top;
 	return 0;
 }
 
-static int invokeMethodInternal(VMContext *c, SobData *sob, int method_num, int class_handle, int obj_handle, int start_call, int is_static) {
-	debug(DBG_VM, "invokeMethodInternal method:%d class_handle:%d obj_handle:%d start_call:%d is_static:%d", method_num, class_handle, obj_handle, start_call, is_static);
-	const SobRefEntry *ref = Sob_GetRefMethod(sob, method_num);
-	const int code_num = ref->data_index;
-	if (code_num == 0) {
-		error("Calling method on incorrect object %d for variable type %d", obj_handle, class_handle);
+static int invokeMethodInternal(VMContext *c, const VMMethodCacheEntry *m, int obj_handle, int start_call, int is_static) {
+	debug(DBG_VM, "invokeMethodInternal method:%d class_handle:%d obj_handle:%d start_call:%d is_static:%d", m->method_num, m->class_handle, obj_handle, start_call, is_static);
+	if (!m->sob) { /* undefined _new_ or _delete_ */
+		return 0;
+	}
+	const int method_num = m->method_num;
+	if (!m->code) {
+		error("Calling method on incorrect object %d for variable type %d", obj_handle, m->class_handle);
 	}
 	if (start_call != 0) {
-		if ((ref->flags & 2) != 0 && is_static == 0) {
+		if ((m->flags & 2) != 0 && is_static == 0) {
 			error("Object start of static script @%d", method_num);
 		}
-		if ((ref->flags & 2) == 0 && is_static != 0) {
+		if ((m->flags & 2) == 0 && is_static != 0) {
 			error("Static start of object script @%d", method_num);
 		}
-		if ((ref->flags & 8) == 0) {
+		if ((m->flags & 8) == 0) {
 			error("Script @%d called as a method", method_num);
 			return 0;
 		}
-		if (ref->name_index != 0) {
-			debug(DBG_VM, "Starting %s.%s", ClassHandle_GetName(c, class_handle), Sob_GetString(sob, ref->name_index));
+		if (m->name_index != 0) {
+			debug(DBG_VM, "Starting %s.%s", ClassHandle_GetName(c, m->class_handle), Sob_GetString(m->sob, m->name_index));
 		}
-		const int ret = startMethod(c, class_handle, obj_handle, code_num);
+		const int ret = startMethod(c, m->code, obj_handle);
 		if (ret != 0) {
 			if (start_call == 3) {
 				c->script->state = SCRIPT_STATE_YIELD;
@@ -334,37 +407,73 @@ static int invokeMethodInternal(VMContext *c, SobData *sob, int method_num, int
 		}
 		return ret;
 	} else {
-		if ((ref->flags & 2) != 0 && is_static == 0) {
+		if ((m->flags & 2) != 0 && is_static == 0) {
 			error("Object call of static method @%d", method_num);
 		}
-		if ((ref->flags & 2) == 0 && is_static != 0) {
+		if ((m->flags & 2) == 0 && is_static != 0) {
 			error("Static call of object script @%d", method_num);
 		}
-		if ((ref->flags & 8) != 0) {
+		if ((m->flags & 8) != 0) {
 			error("Method @%d called as a script", method_num);
 			return 0;
 		}
 		if (!c->script) {
 			error("Trying to call method @%d with no current method running", method_num);
 		}
-		if (ref->name_index != 0) {
-			debug(DBG_VM, "Calling %s.%s", ClassHandle_GetName(c, class_handle), Sob_GetString(sob, ref->name_index));
+		if (m->name_index != 0) {
+			debug(DBG_VM, "Calling %s.%s", ClassHandle_GetName(c, m->class_handle), Sob_GetString(m->sob, m->name_index));
 		}
-		callMethod(c, c->script, class_handle, obj_handle, code_num);
+		callMethod(c, c->script, m->code, obj_handle);
 	}
 	return 0;
 }
 
-int VM_InvokeMethod(VMContext *c, SobData *sob, int member_index, int obj_handle, int start_call, int is_static, int is_parent) {
+static void setMethodEntry(VMContext *c, VMMethodCacheEntry *m, SobData *sob, int method_num, int class_handle) {
+	const SobRefEntry *ref = Sob_GetRefMethod(sob, method_num);
+	m->class_handle = class_handle;
+	m->sob = sob;
+	m->method_num = method_num;
+	m->flags = ref->flags;
+	m->name_index = ref->name_index;
+	m->code = 0;
+	const int slot = sob->ref_slots ? sob->ref_slots[method_num] : -1;
+	if (slot >= 0 && sob->vtable[slot].method_num == method_num && sob->vtable[slot].code && sob->vtable[slot].code->class_handle != -1) {
+		m->code = sob->vtable[slot].code;
+	}
+	if (!m->code && ref->data_index != 0) {
+		m->code = getMethodCode(c, class_handle, ref->data_index);
+	}
+}
+
+static int getReceiverClass(VMContext *c, int obj_handle) {
+	VMObject *obj = VM_GetObjectFromHandle(c, obj_handle);
+	if (!obj) {
+		error("Object handle %d was deleted", obj_handle);
+	}
+	return obj->class_handle;
+}
+
+/* the vtable slot of the reference is kept if the receiver class declares the method there */
+static int findReceiverMethod(SobData *sob, int member_index, SobData *sob2, const char *name) {
+	const int slot = sob->ref_slots ? sob->ref_slots[member_index] : -1;
+	if (slot >= 0 && slot < sob2->vtable_count) {
+		const SobMethodSlot *s = &sob2->vtable[slot];
+		if (s->name && strcmp(s->name, name) == 0) {
+			return s->method_num;
+		}
+	}
+	const int num = Sob_FindMethod(sob2, name);
+	if (num != 0 && slot == -1 && sob->ref_slots && sob2->ref_slots) {
+		sob->ref_slots[member_index] = sob2->ref_slots[num];
+	}
+	return num;
+}
+
+static void resolveMethod(VMContext *c, VMMethodCacheEntry *m, SobData *sob, int member_index, int obj_handle, int is_parent) {
 	SobRefEntry *refMethod = Sob_GetRefMethod(sob, member_index);
 	int class_handle = 0;
 	if (obj_handle != 0) {
-		VMObject *obj = VM_GetObjectFromHandle(c, obj_handle);
-		if (!obj) {
-			error("Object handle %d was deleted", obj_handle);
-		} else {
-			class_handle = obj->class_handle;
-		}
+		class_handle = getReceiverClass(c, obj_handle);
 	} else {
 		SobRefEntry *refClass = Sob_GetRefClass(sob, refMethod->class_index);
 		if (refClass->class_handle == 0) {
@@ -374,7 +483,8 @@ int VM_InvokeMethod(VMContext *c, SobData *sob, int member_index, int obj_handle
 		class_handle = refClass->class_handle;
 	}
 	if (refMethod->data_index != 0 && is_parent == 0 && sob->class_handle == class_handle) {
-		return invokeMethodInternal(c, sob, member_index, class_handle, obj_handle, start_call, is_static);
+		setMethodEntry(c, m, sob, member_index, class_handle);
+		return;
 	}
 	if (obj_handle != 0) {
 		if (is_parent != 0) {
@@ -397,34 +507,203 @@ int VM_InvokeMethod(VMContext *c, SobData *sob, int member_index, int obj_handle
 		class_handle = ref->data_index;
 	}
 	SobData *sob2 = ClassHandle_GetSob(c, class_handle);
-	if (refMethod->member_index == 0) {
-		const char *method = Sob_GetString(sob, refMethod->name_index);
-		const int num = Sob_FindMethod(sob2, method);
-		if (num == 0) {
-			if (strcasecmp("_new_()V", method) == 0) {
-				return 0;
-			} else if (strcasecmp("_delete_()V", method) == 0) {
-				return 0;
-			}
-			error("Can't find method %s in class %d", method, class_handle);
+	const char *method = Sob_GetString(sob, refMethod->name_index);
+	const int num = findReceiverMethod(sob, member_index, sob2, method);
+	if (num == 0) {
+		if (strcasecmp("_new_()V", method) == 0 || strcasecmp("_delete_()V", method) == 0) {
+			memset(m, 0, sizeof(VMMethodCacheEntry));
+			m->class_handle = class_handle;
+			return;
+		}
+		error("Can't find method %s in class %d", method, class_handle);
+	}
+	setMethodEntry(c, m, sob2, num, class_handle);
+}
+
+int VM_InvokeMethod(VMContext *c, SobData *sob, int member_index, int obj_handle, int start_call, int is_static, int is_parent) {
+	VMMethodCacheEntry m;
+	resolveMethod(c, &m, sob, member_index, obj_handle, is_parent);
+	return invokeMethodInternal(c, &m, obj_handle, start_call, is_static);
+}
+
+int VM_InvokeMethodCached(VMContext *c, VMMethodCache *cache, SobData *sob, int member_index, int obj_handle, int start_call, int is_static, int is_parent) {
+	const uint32_t key = (obj_handle != 0) ? getReceiverClass(c, obj_handle) : 0;
+	for (int i = 0; i < cache->count; ++i) {
+		if (cache->entries[i].key == key) {
+			return invokeMethodInternal(c, &cache->entries[i], obj_handle, start_call, is_static);
+		}
+	}
+	if (cache->count == VMINLINECACHE_SIZE) { /* megamorphic */
+		return VM_InvokeMethod(c, sob, member_index, obj_handle, start_call, is_static, is_parent);
+	}
+	VMMethodCacheEntry *m = &cache->entries[cache->count];
+	resolveMethod(c, m, sob, member_index, obj_handle, is_parent);
+	m->key = key;
+	++cache->count;
+	return invokeMethodInternal(c, m, obj_handle, start_call, is_static);
+}
+
+static uint32_t hashClassName(const char *s) {
+	uint32_t hash = 2166136261u; /* FNV-1a */
+	while (*s) {
+		uint8_t chr = *s++;
+		if (chr >= 'A' && chr <= 'Z') {
+			chr += 'a' - 'A';
+		}
+		hash ^= chr;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static VMClassName *findClassName(VMContext *c, const char *name, uint32_t hash) {
+	for (uint32_t pos = hash; ; ++pos) {
+		VMClassName *cn = &c->class_names[pos & (c->class_names_size - 1)];
+		if (!cn->name || (cn->hash == hash && strcasecmp(name, cn->name) == 0)) {
+			return cn;
+		}
+	}
+}
+
+static void growClassNames(VMContext *c) {
+	VMClassName *prev = c->class_names;
+	const int prev_size = c->class_names_size;
+	c->class_names_size *= 2;
+	c->class_names = (VMClassName *)calloc(c->class_names_size, sizeof(VMClassName));
+	if (!c->class_names) {
+		error("Failed to allocate %d class names", c->class_names_size);
+	}
+	for (int i = 0; i < prev_size; ++i) {
+		if (prev[i].name) {
+			*findClassName(c, prev[i].name, prev[i].hash) = prev[i];
+		}
+	}
+	free(prev);
+	debug(DBG_VM, "Class names registry size %d", c->class_names_size);
+}
+
+static void addClassName(VMContext *c, const char *name, int handle) {
+	if (c->class_names_count >= c->class_names_size * 3 / 4) {
+		growClassNames(c);
+	}
+	const uint32_t hash = hashClassName(name);
+	VMClassName *cn = findClassName(c, name, hash);
+	if (cn->name) {
+		if (cn->handle == 0) { /* class previously not found */
+			free((char *)cn->name);
+			cn->name = name;
+			cn->handle = handle;
+		}
+		return;
+	}
+	if (handle == 0) {
+		name = strdup(name);
+		if (!name) {
+			return;
 		}
-		refMethod->member_index = num;
 	}
-	return invokeMethodInternal(c, sob2, refMethod->member_index, class_handle, obj_handle, start_call, is_static);
+	cn->name = name;
+	cn->hash = hash;
+	cn->handle = handle;
+	++c->class_names_count;
 }
 
 int VM_FindOrLoadClass(VMContext *context, const char *name, int error_flag) {
 	assert(name);
 	debug(DBG_VM, "VM_FindOrLoadClass '%s' count:%d", name, context->classes_count);
-	for (int i = 1; i < context->classes_count; ++i) {
-		const VMClass *c = &context->classes[i];
-		if (c->name && strcasecmp(name, c->name) == 0) {
-			assert(c->sob_data);
-			debug(DBG_VM, "Found class num:%d sob:%p", i, c->sob_data);
-			return BASE_HANDLE_CLASS + i;
+	const VMClassName *cn = findClassName(context, name, hashClassName(name));
+	if (cn->name) {
+		if (cn->handle != 0) {
+			debug(DBG_VM, "Found class handle:%d", cn->handle);
+			return cn->handle;
+		}
+		if (error_flag) {
+			error("Failed to load class '%s'", name);
+		}
+		return 0;
+	}
+	const int handle = VM_LoadClass(context, name, error_flag);
+	if (handle == 0) {
+		addClassName(context, name, 0);
+	}
+	return handle;
+}
+
+static int isClassMethod(const SobData *sob, int num) {
+	const SobRefEntry *ref = &sob->refentries_data[num];
+	return ref->class_index == 1 && ref->type == SOB_REFERENCE_TYPE_METHOD && ref->name_index != 0 && ref->name_index <= sob->stringentries_count;
+}
+
+/* the parent methods are usually at the same reference index */
+static int findSlotMethod(SobData *sob, const SobMethodSlot *slot) {
+	const int num = slot->method_num;
+	if (num <= sob->refentries_count && isClassMethod(sob, num) && strcmp(Sob_GetString(sob, sob->refentries_data[num].name_index), slot->name) == 0) {
+		return num;
+	}
+	return Sob_FindMethod(sob, slot->name);
+}
+
+static void buildVtable(SobData *sob, SobData *parentSob) {
+	const int parent_count = parentSob ? parentSob->vtable_count : 0;
+	sob->vtable = (SobMethodSlot *)calloc(parent_count + sob->refentries_count, sizeof(SobMethodSlot));
+	sob->ref_slots = (int *)malloc((sob->refentries_count + 1) * sizeof(int));
+	if (!sob->vtable || !sob->ref_slots) {
+		error("Failed to allocate vtable for class '%s'", sob->class_name);
+	}
+	for (int i = 0; i <= sob->refentries_count; ++i) {
+		sob->ref_slots[i] = -1;
+	}
+	/* inherited slots, replaced by the class methods of the same name */
+	for (int i = 0; i < parent_count; ++i) {
+		const SobMethodSlot *parentSlot = &parentSob->vtable[i];
+		const int num = parentSlot->name ? findSlotMethod(sob, parentSlot) : 0;
+		if (num != 0) {
+			sob->vtable[i].name = Sob_GetString(sob, sob->refentries_data[num].name_index);
+			sob->vtable[i].method_num = num;
+			sob->ref_slots[num] = i;
+		}
+	}
+	sob->vtable_count = parent_count;
+	for (int i = 1; i <= sob->refentries_count; ++i) {
+		if (!isClassMethod(sob, i) || sob->ref_slots[i] != -1) {
+			continue;
+		}
+		const char *name = Sob_GetString(sob, sob->refentries_data[i].name_index);
+		const int num = Sob_FindMethod(sob, name);
+		if (num != i) { /* duplicate name */
+			sob->ref_slots[i] = sob->ref_slots[num];
+			continue;
+		}
+		SobMethodSlot *slot = &sob->vtable[sob->vtable_count];
+		slot->name = name;
+		slot->method_num = i;
+		sob->ref_slots[i] = sob->vtable_count++;
+	}
+	/* the methods without code are taken from the parent slot */
+	for (int i = 1; i <= sob->refentries_count; ++i) {
+		const SobRefEntry *ref = &sob->refentries_data[i];
+		if (ref->class_index != 1 || ref->type != SOB_REFERENCE_TYPE_METHOD || ref->data_index == 0) {
+			continue;
+		}
+		SobCodeEntry *code = Sob_GetCode(sob, ref->data_index);
+		if (code->locals_offset == -1 && parentSob) {
+			const int slot = sob->ref_slots[i];
+			const SobCodeEntry *parentCodeEntry = (slot >= 0 && slot < parent_count) ? parentSob->vtable[slot].code : 0;
+			if (!parentCodeEntry || parentCodeEntry->code_ptr == 0) {
+				error("Virtual function %s not found in class %d", Sob_GetString(sob, ref->name_index), sob->parent_handle);
+				continue;
+			}
+			code->code_offset = parentCodeEntry->code_offset;
+			code->code_ptr = parentCodeEntry->code_ptr;
+			code->locals_ptr = parentCodeEntry->locals_ptr;
+			code->class_handle = parentCodeEntry->class_handle;
+			// code->unk14 = parentCodeEntry->unk14;
+		}
+		const int slot = sob->ref_slots[i];
+		if (slot >= 0 && sob->vtable[slot].method_num == i) {
+			sob->vtable[slot].code = code;
 		}
 	}
-	return VM_LoadClass(context, name, error_flag);
 }
 
 static void fixUp(VMContext *c, SobData *sob) {
@@ -442,6 +721,7 @@ static void fixUp(VMContext *c, SobData *sob) {
 			code->class_handle = sob->class_handle;
 		}
 	}
+	SobData *parentSob = 0;
 	if (sob->frameworks_count > 0) {
 		const int num = sob->frameworks_data[0];
 		SobRefEntry *ref = Sob_GetRefClass(sob, num);
@@ -449,35 +729,22 @@ static void fixUp(VMContext *c, SobData *sob) {
 		const int parent_handle = VM_FindOrLoadClass(c, name, 1);
 		sob->parent_handle = parent_handle;
 		debug(DBG_VM, "ParentClass handle %d name '%s'", parent_handle, name);
-		if (!sob->fixup_flag) {
-			SobData *parentSob = ClassHandle_GetSob(c, parent_handle);
-			for (int i = 1; i <= sob->refentries_count; ++i) {
-				const SobRefEntry *ref = &sob->refentries_data[i];
-				if (ref->class_index == 1 && ref->type == SOB_REFERENCE_TYPE_METHOD) {
-					SobCodeEntry *code = &sob->codeentries_data[ref->data_index];
-					if (code->locals_offset != -1) {
-						continue;
-					}
-					const char *name = Sob_GetString(sob, ref->name_index);
-					int method_num = Sob_FindMethod(parentSob, name);
-					if (method_num == 0) {
-						error("Virtual function %s not found in class %d", name, sob->parent_handle);
-						continue;
-					}
-					const SobRefEntry *methodRef = Sob_GetRefMethod(parentSob, method_num);
-					const SobCodeEntry *parentCodeEntry = &parentSob->codeentries_data[methodRef->data_index];
-					if (parentCodeEntry->code_ptr == 0) {
-						error("Virtual function %s not found in class %d", name, sob->parent_handle);
-						continue;
-					}
-					code->code_offset = parentCodeEntry->code_offset;
-					code->code_ptr = parentCodeEntry->code_ptr;
-					code->locals_ptr = parentCodeEntry->locals_ptr;
-					code->class_handle = parentCodeEntry->class_handle;
-					// code->unk14 = parentCodeEntry->unk14;
-				}
-			}
+		if (sob->fixup_flag) {
+			return;
 		}
+		parentSob = ClassHandle_GetSob(c, parent_handle);
+	}
+	buildVtable(sob, parentSob);
+	for (int i = 1; i <= sob->default_membervars_count; ++i) {
+		VM_CheckVarType(sob->default_membervars_data[i].type);
+	}
+	sob->new_method = Sob_FindMethod(sob, "_new_()V");
+	sob->delete_method = Sob_FindMethod(sob, "_delete_()V");
+	Insn_DecodeSob(c, sob);
+	VM_VerifySob(c, sob);
+	Insn_FuseSob(c, sob);
+	if (c->aot) {
+		VM_AotBindSob(c, sob);
 	}
 	sob->fixup_flag = 1;
 }
@@ -488,7 +755,7 @@ static int startStaticClassMethod(VMContext *c, int class_handle, const char *na
 	if (method_num != 0) {
 		const SobRefEntry *ref = &sob->refentries_data[method_num];
 		if (ref->data_index != 0) {
-			startMethod(c, class_handle, 0, ref->data_index);
+			startMethod(c, getMethodCode(c, class_handle, ref->data_index), 0);
 			return 1;
 		}
 	}
@@ -519,15 +786,17 @@ int VM_LoadClass(VMContext *context, const char *name, int error_flag) {
 
 		sob->class_handle = handle;
 
-		fixUp(context, sob);
-
 		SobRefEntry *ref = Sob_GetRefClass(sob, 1); /* class name is first reference */
 		const char *class_name = Sob_GetString(sob, ref->name_index);
-		debug(DBG_VM, "Class handle %d name %s sob %p", sob->class_handle, class_name, sob);
 		sob->class_name = class_name;
+
+		fixUp(context, sob);
+
+		debug(DBG_VM, "Class handle %d name %s sob %p", sob->class_handle, class_name, sob);
 		c->name = class_name;
+		addClassName(context, class_name, handle);
 		const int method_num = Sob_FindMethod(sob, "_static_()V");
-		if (method_num != 0) {
+		if (method_num != 0 && !context->load_only) {
 			startStaticClassMethod(context, handle, "_static_()V");
 		}
 		for (int i = 0; i < sob->autoload_count; ++i) {
@@ -551,6 +820,11 @@ void VM_StartCallback(VMContext *c, int handle, const char *name) {
 
 void VM_RunThreads(VMContext *context) {
 	++context->frame_counter;
+	if (context->gc_budget_us > 0) {
+		VM_GCStep(context);
+	} else if (context->gc_counter > 0 && (context->frame_counter % context->gc_counter) == 0) {
+		VM_GC(context, 0);
+	}
 	VMThread *thread = context->threads_head;
 	while (thread) {
 		thread->unk1C = 0;
@@ -619,10 +893,6 @@ next:
 	}
 }
 
-void VM_GC(int flag) {
-	/* todo */
-}
-
 int VM_ConvertVar(int type, const VMVar *var) { /* to, from */
 	if (type != var->type && var->value != 0 && (type & 0xFF) != 12 && (var->type & 0xFF) != 12) {
 		if (var->type == 9 && type <= 7) {
@@ -697,8 +967,12 @@ VMVar *VM_GetLocalVar(VMContext *c, int num) {
 }
 
 VMVar *VM_GetObjectMemberVar(VMContext *c, VMObject *obj, int num) {
+	SobRefEntry *ref = Sob_GetRefMember(c->script->sob_data, num);
+	return Object_GetMemberVar(obj, VM_GetObjectMemberIndex(c, obj, ref));
+}
+
+int VM_GetObjectMemberIndex(VMContext *c, VMObject *obj, SobRefEntry *ref) {
 	SobData *sob1 = c->script->sob_data;
-	SobRefEntry *ref = Sob_GetRefMember(sob1, num);
 	if (ref->member_index == 0) {
 		const int class_handle = VM_GetClassHandleFromRef(c, sob1, ref->class_index, 1);
 		SobData *sob2 = ClassHandle_GetSob(c, class_handle);
@@ -714,8 +988,7 @@ VMVar *VM_GetObjectMemberVar(VMContext *c, VMObject *obj, int num) {
 	if ((ref2->flags & 2) != 0) {
 		error("Member access to static variable @%d", member_num);
 	}
-	VMVar *member = Object_GetMemberVar(obj, ref2->data_index);
-	return member;
+	return ref2->data_index;
 }
 
 const char *VM_GetVarTypeName(int type) {
@@ -1007,7 +1280,7 @@ int VM_CountThreads(VMContext *c, int num) {
 void VM_DeleteObject(VMContext *c, VMObject *obj, int call_delete) {
 	if (call_delete) {
 		SobData *sob = ClassHandle_GetSob(c, obj->class_handle);
-		const int num = Sob_FindMethod(sob, "_delete_()V");
+		const int num = sob->delete_method;
 		if (num != 0) {
 			if (c->script) {
 				VM_InvokeMethod(c, sob, num, obj->handle, 0, 0, 0);
@@ -5,12 +5,14 @@
 #include "intern.h"
 #include "sob.h"
 
-#define SYSCALLS_COUNT   192
-#define VMCLASSES_COUNT 1024
-#define VMARRAYS_COUNT  4096
-#define VMOBJECTS_COUNT 1024
-#define VMTHREADS_COUNT  128
-#define VMSTACK_SIZE    1024
+#define SYSCALLS_COUNT     192
+#define VMCLASSES_COUNT   1024
+#define VMCLASSNAMES_SIZE 4096
+#define VMFRAMES_SIZE    65536
+#define VMLOCALS_POOLSIZE  256
+#define VMSTACK_SIZE      1024
+#define VMJIT_THRESHOLD     64
+#define VMAOT_VERSION        1
 
 enum {
 	VAR_TYPE_BYTE   = 4,
@@ -30,6 +32,20 @@ enum {
 	BASE_HANDLE_FILE   = 7000000,
 };
 
+/* handles are BASE + (generation << VMHANDLE_INDEX_BITS | slot) */
+#define VMHANDLE_INDEX_BITS 15
+#define VMHANDLE_INDEX_MASK ((1 << VMHANDLE_INDEX_BITS) - 1)
+#define VMHANDLE_GENERATIONS(base, next) (((next) - (base)) >> VMHANDLE_INDEX_BITS)
+
+/* the pools grow by chunks, the slots never move */
+#define VMPOOL_CHUNK_SIZE 256
+/* the freed slots are reused in FIFO order, the pools grow while fewer slots are free */
+#define VMPOOL_MIN_FREE   1024
+#define VMPOOL_CHUNKS     ((1 << VMHANDLE_INDEX_BITS) / VMPOOL_CHUNK_SIZE)
+
+/* arrays data up to this size is stored in the VMArrayInfo */
+#define VMARRAY_INLINE_SIZE 24
+
 enum {
 	SCRIPT_STATE_RUNNING = 1,
 	SCRIPT_STATE_SUSPEND = 2,
@@ -38,9 +54,32 @@ enum {
 	SCRIPT_STATE_YIELD   = 5
 };
 
+enum {
+	SCRIPT_LOCALS_HEAP  = 0,
+	SCRIPT_LOCALS_FRAME = 1, /* context frame stack */
+	SCRIPT_LOCALS_POOL  = 2  /* kept with the pooled thread script */
+};
+
 struct SobData;
 struct SobVar;
 
+typedef struct vmgc_t VMGC;
+typedef struct vmheap_t VMHeap;
+typedef struct vmjit_t VMJit;
+typedef struct vmaot_t VMAot;
+
+/* power-of-two size classes from 16 to 4096 bytes, the last entry is for larger blocks */
+#define VMHEAP_CLASSES 9
+
+typedef struct {
+	int block_size;
+	int count;
+	int live_bytes;
+	int wasted_bytes;
+	int peak_bytes;
+	int slabs_bytes;
+} VMHeapStats;
+
 typedef struct {
 	int type;
 	int value;
@@ -58,35 +97,56 @@ typedef struct {
 	SobData *sob_data;
 } VMClass;
 
+typedef struct {
+	const char *name; /* allocated for the classes not found */
+	uint32_t hash;
+	int handle;
+} VMClassName;
+
 struct vmarray_key_value_t {
 	int key;
 	int value;
 };
 
+/* the fields read by the element accessors, 32 bytes */
 typedef struct {
+	uint8_t *data;
 	uint32_t handle;
+	uint32_t offset;
+	int col_lower;
+	int col_upper;
 	uint16_t next_free;
+	uint16_t elem_size;
+	uint8_t generation;
+	uint8_t gc_dirty; /* written since last traced */
+	uint8_t is_key_value;
+	uint8_t slot; /* index in the pool chunk */
+} VMArray;
+
+/* the pool chunks store the VMArrayInfo table after the VMArray headers */
+typedef struct {
 	int type;
-	int elem_size;
-	uint8_t *data;
 	int dimension;
-	int col_lower;
-	int col_upper;
 	int row_lower;
 	int row_upper;
-	uint32_t offset;
 	int unk28;
 	int unk34;
 	int unk40;
 	int struct_size;
-	int is_key_value;
+	int str_length; /* -1 if unknown */
+	int is_const; /* data points to the SobData strings, copied on first write */
 	struct vmarray_key_value_t *kv_data;
-	int kv_size;
-} VMArray;
+	int kv_size, kv_capacity;
+	int *kv_index;
+	uint32_t kv_mask;
+	uint8_t inline_data[VMARRAY_INLINE_SIZE];
+} VMArrayInfo;
 
 typedef struct {
 	uint32_t handle;
 	uint16_t next_free;
+	uint8_t generation;
+	uint8_t gc_dirty;
 	uint32_t class_handle;
 	int members_count;
 	VMVar *members;
@@ -97,6 +157,7 @@ struct vmscript_t;
 typedef struct vmthread_t {
 	uint32_t handle;
 	uint16_t next_free;
+	uint16_t generation;
 	int id;
 	int order;
 	int script_thread_handle;
@@ -110,6 +171,46 @@ typedef struct vmthread_t {
 	uint32_t labels[8];
 } VMThread;
 
+#define VMINLINECACHE_SIZE 4
+
+typedef struct {
+	SobRefEntry *ref;
+	int count, next;
+	uint32_t class_handle[VMINLINECACHE_SIZE];
+	int data_index[VMINLINECACHE_SIZE];
+} VMMemberCache;
+
+typedef struct {
+	uint32_t key; /* receiver class handle, 0 for static calls */
+	uint32_t class_handle;
+	SobData *sob;
+	int method_num;
+	uint32_t flags;
+	uint32_t name_index;
+	SobCodeEntry *code;
+} VMMethodCacheEntry;
+
+typedef struct {
+	int count;
+	VMMethodCacheEntry entries[VMINLINECACHE_SIZE];
+} VMMethodCache;
+
+typedef struct vminsn_t {
+	uint8_t op;
+	uint8_t len; /* size of the opcode in the bytecode, 0 if not decoded */
+	uint8_t type;
+	uint8_t count;
+	int32_t num;
+	union {
+		SobRefEntry *ref;
+		SobVar *var;
+		const char *str;
+		struct vminsn_t *target;
+		VMMemberCache *member;
+		VMMethodCache *method;
+	};
+} VMInsn;
+
 typedef struct vmscript_t {
 	VMThread *thread;
 	VMObject *obj;
@@ -120,9 +221,10 @@ typedef struct vmscript_t {
 	int state;
 	struct vmscript_t *next_script;
 	uint32_t code_offset;
-	const uint8_t *code_data;
 	int local_vars_count;
 	VMVar *local_vars;
+	int locals_alloc;
+	int locals_capacity;
 } VMScript;
 
 typedef struct vmcontext_t {
@@ -130,25 +232,71 @@ typedef struct vmcontext_t {
 	VMSyscall syscalls[SYSCALLS_COUNT];
 	int classes_count;
 	VMClass classes[VMCLASSES_COUNT];
-	int arrays_next_free;
-	VMArray arrays[VMARRAYS_COUNT];
-	int objects_next_free;
-	VMObject objects[VMOBJECTS_COUNT];
-	int threads_next_free;
-	VMThread threads[VMTHREADS_COUNT];
+	int class_names_count, class_names_size;
+	VMClassName *class_names;
+	int arrays_next_free, arrays_free_tail, arrays_count, arrays_capacity;
+	VMArray *arrays[VMPOOL_CHUNKS];
+	int objects_next_free, objects_free_tail, objects_count, objects_capacity;
+	VMObject *objects[VMPOOL_CHUNKS];
+	int threads_next_free, threads_free_tail, threads_capacity;
+	VMThread *threads[VMPOOL_CHUNKS];
+	VMScript *scripts[VMPOOL_CHUNKS]; /* thread root scripts */
+	int scripts_count, scripts_peak;
 	VMVar stack[VMSTACK_SIZE];
 	int sp;
-	const uint8_t *code;
+	VMVar *frames;
+	int frames_top;
+	VMInsn *code;
 	VMScript *script;
 	int gameID;
-	int gc_counter;
+	int gc_counter; /* -2 before every method call, -1 now, >0 every N frames */
+	int gc_budget_us; /* incremental marking time per frame, 0 to disable */
+	VMGC *gc; /* pending incremental cycle */
+	VMHeap *heap; /* arrays data and objects members */
+	VMJit *jit; /* 0 if disabled */
+	VMAot *aot; /* translated classes, 0 if disabled */
+	int load_only; /* do not run the static methods, eg. for the translation */
 	int frame_counter;
 	int method_call_depth;
 	VMThread *threads_head, *threads_tail;
-	int thread_handle_counter;
 	uint32_t (*get_timer)();
+	uint32_t (*get_timer_us)();
 } VMContext;
 
+/* returns 0 if the method at c->code is not translated, 1 on exit with c->code and c->sp updated */
+typedef int (*VMAotProc)(VMContext *c, VMScript *script, VMInsn *insns);
+
+typedef struct {
+	const char *class_name;
+	uint32_t code_size;
+	uint32_t hash; /* code and locals data */
+	VMAotProc proc;
+} VMAotClass;
+
+/* exported as 'VM_AotModule' by the translated classes */
+typedef struct {
+	int version;
+	int context_size, script_size, insn_size;
+	int classes_count;
+	const VMAotClass *classes;
+} VMAotModule;
+
+static inline VMArray *VM_GetArraySlot(VMContext *c, int num) {
+	return &c->arrays[num / VMPOOL_CHUNK_SIZE][num % VMPOOL_CHUNK_SIZE];
+}
+
+static inline VMArrayInfo *Array_GetInfo(VMArray *array) {
+	return (VMArrayInfo *)(array - array->slot + VMPOOL_CHUNK_SIZE) + array->slot;
+}
+
+static inline VMObject *VM_GetObjectSlot(VMContext *c, int num) {
+	return &c->objects[num / VMPOOL_CHUNK_SIZE][num % VMPOOL_CHUNK_SIZE];
+}
+
+static inline VMThread *VM_GetThreadSlot(VMContext *c, int num) {
+	return &c->threads[num / VMPOOL_CHUNK_SIZE][num % VMPOOL_CHUNK_SIZE];
+}
+
 VMContext *VM_NewContext();
 void VM_FreeContext(VMContext *);
 void VM_DefineInt(VMContext *, const char *name, uint32_t value);
@@ -162,17 +310,19 @@ void VM_ExecuteSyscallByIndex(VMContext *, int index);
 void VM_RunMainBoot(VMContext *c, const char *name, const char *params);
 int VM_InvokeStaticMethod(VMContext *c, const char *class_name, const char *static_name);
 int VM_InvokeMethod(VMContext *c, SobData *sob, int member_index, int obj_handle, int start_call, int is_static, int is_parent);
+int VM_InvokeMethodCached(VMContext *c, VMMethodCache *cache, SobData *sob, int member_index, int obj_handle, int start_call, int is_static, int is_parent);
 int VM_StartMethod(VMContext *c, int obj_handle, const char *name);
 int VM_FindOrLoadClass(VMContext *, const char *name, int error_flag);
 int VM_LoadClass(VMContext *, const char *name, int error_flag);
 void VM_StartCallback(VMContext *, int handle, const char *name);
 void VM_RunThreads(VMContext *);
-void VM_GC(int);
 int VM_ConvertVar(int type, const VMVar *var);
 void VM_CheckVarType(int type);
 SobVar *VM_GetClassStaticVar(VMContext *c, SobData *sob, int num);
 VMVar *VM_GetLocalVar(VMContext *c, int num);
+const SobVar *VM_GetLocalsTemplate(SobCodeEntry *code);
 VMVar *VM_GetObjectMemberVar(VMContext *c, VMObject *obj, int num);
+int VM_GetObjectMemberIndex(VMContext *c, VMObject *obj, SobRefEntry *ref);
 const char *VM_GetVarTypeName(int type);
 VMClass *VM_GetClassFromHandle(VMContext *c, int num);
 int VM_GetClassHandleFromRef(VMContext *c, SobData *sob, int num, int flag);
@@ -184,9 +334,48 @@ void VM_StopThread(VMContext *c, int num, int handle);
 int VM_CountThreads(VMContext *c, int num);
 void VM_DeleteObject(VMContext *c, VMObject *obj, int call_delete);
 
+// vm_aot
+VMAot *VM_LoadAot(const char *path);
+void VM_FreeAot(VMAot *aot);
+void VM_AotBindSob(VMContext *c, SobData *sob);
+int VM_AotCallOpcode(VMContext *c, VMInsn *insn);
+int VM_AotExecute(VMContext *c, VMScript *script);
+void VM_WriteAot(VMContext *c, const char *path);
+
+// vm_gc
+int VM_GC(VMContext *c, int flag);
+void VM_GCStep(VMContext *c);
+void VM_GCMarkNew(VMContext *c, uint32_t handle);
+
+// vm_heap
+VMHeap *VM_NewHeap();
+void VM_FreeHeap(VMHeap *heap);
+void *VM_HeapAlloc(VMHeap *heap, int size, int clear);
+void *VM_HeapRealloc(VMHeap *heap, void *p, int size);
+void VM_HeapFree(VMHeap *heap, void *p);
+void VM_DumpHeapStats(VMHeap *heap);
+
+// vm_insn
+int Insn_GetSize(int op, int gameID);
+void Insn_DecodeAt(VMContext *c, SobData *sob, uint32_t offset);
+void Insn_DecodeSob(VMContext *c, SobData *sob);
+void Insn_FuseSob(VMContext *c, SobData *sob);
+int Insn_GetSuccessors(SobData *sob, VMInsn *insn, int *offsets);
+
+// vm_jit
+VMJit *VM_NewJit(int threshold, int check);
+void VM_FreeJit(VMJit *jit);
+void VM_JitCountCall(VMContext *c, SobCodeEntry *code);
+int VM_JitExecute(VMContext *c, VMScript *script);
+
 // vm_opcodes
 void VM_InitOpcodes();
-void VM_ExecuteOpcode(VMContext *c, int op);
+void VM_ExecuteInsn(VMContext *c, VMInsn *insn);
+void VM_Execute(VMContext *c, VMScript *script);
+void VM_DumpOpcodesProfile();
+
+// vm_optimize
+void VM_WriteOptimizedClasses(VMContext *c, const char *path);
 
 // vm_stack
 int VM_Pop(VMContext *, int expected_type);
@@ -201,10 +390,13 @@ const char *VM_PopString(VMContext *);
 
 // vm_array
 VMArray *VM_GetArrayFromHandle(VMContext *c, int num);
+VMArray *ArrayHandle_Find(VMContext *c, uint32_t handle);
 VMArray *Array_New(VMContext *c);
 void Array_Dim(VMArray *array, int type, int col_lower, int col_upper);
 void Array_Dim2(VMArray *array, int type, int row_lower, int row_upper, int col_lower, int col_upper);
 void Array_SetString(VMArray *array, const char *s);
+void Array_SetStringBuffer(VMArray *array, const char *s, int len);
+void Array_SetConstString(VMArray *array, const char *s, int len);
 int Array_Get(VMArray *array, int offset);
 void Array_Set(VMArray *array, int offset, int value);
 int Array_Find(VMArray *array, int value);
@@ -235,11 +427,15 @@ int ThreadHandle_FindId(VMContext *c, int handle);
 
 // vm_object
 VMObject *VM_GetObjectFromHandle(VMContext *c, int num);
+VMObject *ObjectHandle_Find(VMContext *c, uint32_t handle);
 VMObject *Object_New(VMContext *c);
 VMVar *Object_GetMemberVar(VMObject *obj, int num);
 int ObjectHandle_Create(VMContext *c, int class_handle);
 void ObjectHandle_Delete(VMContext *c, int obj_handle, int call_delete);
 
+// vm_verify
+void VM_VerifySob(VMContext *c, SobData *sob);
+
 extern const VMSyscall _syscalls_asset[];
 extern const VMSyscall _syscalls_console[];
 extern const VMSyscall _syscalls_debug[];
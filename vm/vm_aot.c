@@ -0,0 +1,407 @@
+#include <dlfcn.h>
+#include "pan.h"
+#include "util.h"
+#include "vm.h"
+
+/* translation of the classes bytecode to C, built as a shared object for a
+ * game and loaded with --aot. The translated code follows VM_Execute, the
+ * other opcodes are called back with VM_ExecuteInsn. Every translated
+ * instruction can be entered, eg. after a breakhere. The methods reaching
+ * an unknown opcode or an invalid jump are left to the interpreter. */
+
+struct vmaot_t {
+	void *handle;
+	const VMAotModule *module;
+};
+
+static uint32_t hashClass(const SobData *sob) {
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	for (int i = 0; i < sob->code_size; ++i) {
+		hash = (hash ^ sob->code_data[i]) * 16777619U;
+	}
+	for (int i = 0; i < sob->local_count; ++i) {
+		hash = (hash ^ sob->local_data[i]) * 16777619U;
+	}
+	return hash;
+}
+
+VMAot *VM_LoadAot(const char *path) {
+	void *handle = dlopen(path, RTLD_NOW);
+	if (!handle) {
+		warning("Unable to load translated classes '%s': %s", path, dlerror());
+		return 0;
+	}
+	const VMAotModule *module = (const VMAotModule *)dlsym(handle, "VM_AotModule");
+	if (!module || module->version != VMAOT_VERSION || module->context_size != sizeof(VMContext) || module->script_size != sizeof(VMScript) || module->insn_size != sizeof(VMInsn)) {
+		warning("Translated classes '%s' do not match the VM version", path);
+		dlclose(handle);
+		return 0;
+	}
+	VMAot *aot = (VMAot *)calloc(1, sizeof(VMAot));
+	if (!aot) {
+		error("Failed to allocate translated classes");
+	}
+	aot->handle = handle;
+	aot->module = module;
+	debug(DBG_INFO, "Loaded %d translated classes from '%s'", module->classes_count, path);
+	return aot;
+}
+
+void VM_FreeAot(VMAot *aot) {
+	if (aot) {
+		dlclose(aot->handle);
+		free(aot);
+	}
+}
+
+void VM_AotBindSob(VMContext *c, SobData *sob) {
+	const VMAotModule *module = c->aot->module;
+	for (int i = 0; i < module->classes_count; ++i) {
+		const VMAotClass *cls = &module->classes[i];
+		if (strcmp(cls->class_name, sob->class_name) == 0) {
+			if (cls->code_size != sob->code_size || cls->hash != hashClass(sob)) {
+				warning("Translated class '%s' does not match the bytecode", sob->class_name);
+				return;
+			}
+			sob->aot = cls;
+			debug(DBG_VM, "Bound translated class '%s'", sob->class_name);
+			return;
+		}
+	}
+}
+
+/* returns 1 if the translated code must exit, for a yield, a return or a
+ * jump done out of line */
+int VM_AotCallOpcode(VMContext *c, VMInsn *insn) {
+	VMScript *script = c->script;
+	VMInsn *next = insn + insn->len;
+	c->code = next;
+	VM_ExecuteInsn(c, insn);
+	if (script->state != 0) {
+		return 1;
+	}
+	if (script->thread->state != SCRIPT_STATE_RUNNING) {
+		script->state = script->thread->state;
+		return 1;
+	}
+	return c->code != next;
+}
+
+int VM_AotExecute(VMContext *c, VMScript *script) {
+	SobData *sob = script->sob_data;
+	const VMAotClass *cls = (const VMAotClass *)sob->aot;
+	if (!cls) {
+		return 0;
+	}
+	while (script->state == 0) {
+		if (!cls->proc(c, script, sob->insns)) {
+			return 0; /* not translated, continue with the interpreter */
+		}
+	}
+	return 1;
+}
+
+static const char *_aotHeader =
+	"/* classes translated with vm --aot-output, built with\n"
+	" * cc -O2 -shared -fPIC -I<path to vm> <file.c> -o <file.so> */\n"
+	"#include \"util.h\"\n"
+	"#include \"vm.h\"\n"
+	"\n"
+	"#define PUSH(val, t) do { stack[sp].value = (val); stack[sp].type = (t); if (++sp >= VMSTACK_SIZE) { error(\"Stack overflow\"); } } while (0)\n"
+	"#define POP(n) do { sp -= (n); if (sp < 0) { error(\"Stack underflow\"); } } while (0)\n"
+	"#define BINOP_INT(expr) do { POP(2); const int a = stack[sp].value; const int b = stack[sp + 1].value; PUSH(expr, VAR_TYPE_INT32); } while (0)\n"
+	"#define CALL(offset) do { c->sp = sp; if (VM_AotCallOpcode(c, &insns[offset])) { return 1; } sp = c->sp; locals = script->local_vars; } while (0)\n"
+	"#define EXIT(offset) do { c->code = &insns[offset]; c->sp = sp; return 1; } while (0)\n"
+	"#define CHECK_LOCAL(num) do { if ((num) > script->local_vars_count) { error(\"Local variable %d out of range (%d..%d)\", (num), 0, script->local_vars_count); } } while (0)\n";
+
+typedef struct {
+	FILE *fp;
+	SobData *sob;
+	const uint8_t *translated;
+} Translator;
+
+static void writeGoto(Translator *t, int offset) {
+	if (t->translated[offset]) {
+		fprintf(t->fp, "\tgoto L%d;\n", offset);
+	} else {
+		fprintf(t->fp, "\tEXIT(%d);\n", offset);
+	}
+}
+
+static const char *compareOperator(int op) {
+	switch (op) {
+	case 0x2c:
+		return "==";
+	case 0x2d:
+		return "!=";
+	case 0x2e:
+		return "<=";
+	case 0x2f:
+		return ">=";
+	case 0x30:
+		return "<";
+	default:
+		return ">";
+	}
+}
+
+/* writes the opcode, returns false if there is no fall-through */
+static bool writeInsn(Translator *t, int offset) {
+	FILE *fp = t->fp;
+	SobData *sob = t->sob;
+	const VMInsn *insn = &sob->insns[offset];
+	const uint32_t num = insn->num;
+	switch (insn->op) {
+	case 0x02: /* op_jump */
+		if (!insn->target) {
+			break;
+		}
+		writeGoto(t, insn->target - sob->insns);
+		return false;
+	case 0x06: /* op_push_int8 */
+	case 0x07: /* op_push_int32 */
+		fprintf(fp, "\tPUSH(%d, VAR_TYPE_INT32);\n", insn->num);
+		return true;
+	case 0x08: /* op_push_local */
+		if (num & 0xFFFF0000) {
+			break;
+		}
+		fprintf(fp, "\tCHECK_LOCAL(%u);\n", num);
+		fprintf(fp, "\tPUSH(locals[%u].value, locals[%u].type);\n", num, num);
+		return true;
+	case 0x09: /* op_push_me */
+		if (insn->count != 1) {
+			break;
+		}
+		fprintf(fp, "\tif (script->obj && insns[%d].member->count != 0 && insns[%d].member->class_handle[0] == script->obj->class_handle) {\n", offset, offset);
+		fprintf(fp, "\t\tconst VMVar *var = &script->obj->members[insns[%d].member->data_index[0]];\n", offset);
+		fprintf(fp, "\t\tPUSH(var->value, var->type);\n");
+		fprintf(fp, "\t} else {\n\t\tCALL(%d);\n\t}\n", offset);
+		return true;
+	case 0x0d: /* op_pop */
+		fprintf(fp, "\tPOP(1);\n");
+		return true;
+	case 0x0e: /* op_pop_local */
+		if (num & 0xFFFF0000) {
+			break;
+		}
+		fprintf(fp, "\tCHECK_LOCAL(%u);\n", num);
+		fprintf(fp, "\tVM_CheckVarType(locals[%u].type);\n", num);
+		fprintf(fp, "\tPOP(1);\n");
+		fprintf(fp, "\tVM_CheckVarType(stack[sp].type);\n");
+		fprintf(fp, "\tlocals[%u].value = VM_ConvertVar(locals[%u].type, &stack[sp]);\n", num, num);
+		return true;
+	case 0x18: /* op_add_int */
+		fprintf(fp, "\tBINOP_INT((int)((uint32_t)a + (uint32_t)b));\n");
+		return true;
+	case 0x19: /* op_sub_int */
+		fprintf(fp, "\tBINOP_INT((int)((uint32_t)a - (uint32_t)b));\n");
+		return true;
+	case 0x1a: /* op_mul_int */
+		fprintf(fp, "\tBINOP_INT((int)((uint32_t)a * (uint32_t)b));\n");
+		return true;
+	case 0x2a: /* op_and */
+		fprintf(fp, "\tBINOP_INT(a != 0 && b != 0);\n");
+		return true;
+	case 0x2b: /* op_or */
+		fprintf(fp, "\tBINOP_INT(a != 0 || b != 0);\n");
+		return true;
+	case 0x2c: /* op_eq_int */
+	case 0x2d: /* op_neq_int */
+	case 0x2e: /* op_leq_int */
+	case 0x2f: /* op_geq_int */
+	case 0x30: /* op_lt_int */
+	case 0x31: /* op_gt_int */
+		fprintf(fp, "\tBINOP_INT(a %s b);\n", compareOperator(insn->op));
+		return true;
+	case 0x28: /* op_if_eq */
+	case 0x29: /* op_if_neq */
+		if (!insn->target) {
+			break;
+		}
+		fprintf(fp, "\tPOP(1);\n");
+		fprintf(fp, "\tif (stack[sp].value %s 0) {\n\t", (insn->op == 0x28) ? "!=" : "==");
+		writeGoto(t, insn->target - sob->insns);
+		fprintf(fp, "\t}\n");
+		return true;
+	case 0x48: /* op_not_int */
+		fprintf(fp, "\tPOP(1);\n");
+		fprintf(fp, "\tPUSH(stack[sp].value == 0, VAR_TYPE_INT32);\n");
+		return true;
+	case 0x6c: /* op_dup */
+		fprintf(fp, "\tif (sp < 1) {\n\t\terror(\"Stack underflow\");\n\t}\n");
+		fprintf(fp, "\tPUSH(stack[sp - 1].value, stack[sp - 1].type);\n");
+		return true;
+	case 0xbc: /* op_iftop_eq */
+	case 0xbd: /* op_iftop_neq */
+		if (!insn->target) {
+			break;
+		}
+		fprintf(fp, "\tif (sp < 1) {\n\t\terror(\"Stack underflow\");\n\t}\n");
+		fprintf(fp, "\tif (stack[sp - 1].value %s 0) {\n\t", (insn->op == 0xbc) ? "!=" : "==");
+		writeGoto(t, insn->target - sob->insns);
+		fprintf(fp, "\t}\n");
+		return true;
+	case 0xc0: /* op_push_local_unchecked */
+		fprintf(fp, "\tPUSH(locals[%u].value, locals[%u].type);\n", num, num);
+		return true;
+	case 0xc1: /* op_pop_local_unchecked */
+		fprintf(fp, "\t--sp;\n");
+		fprintf(fp, "\tlocals[%u].value = stack[sp].value;\n", num);
+		return true;
+	case 0xc2: { /* op_add_local_int */
+			const VMInsn *last = insn->target;
+			fprintf(fp, "\tlocals[%d].value = (int)((uint32_t)locals[%u].value %c (uint32_t)%d);\n", last->num, num, (insn->type == 0x18) ? '+' : '-', (insn + insn->len)->num);
+			writeGoto(t, last + last->len - sob->insns);
+		}
+		return false;
+	case 0xc3: { /* op_if_local_int */
+			const VMInsn *last = insn->target;
+			fprintf(fp, "\tif ((locals[%u].value %s %d) %s 0) {\n\t", num, compareOperator(insn->type), (insn + insn->len)->num, (last->op == 0x28) ? "!=" : "==");
+			writeGoto(t, last->target - sob->insns);
+			fprintf(fp, "\t}\n");
+			writeGoto(t, last + last->len - sob->insns);
+		}
+		return false;
+	}
+	fprintf(fp, "\tCALL(%d);\n", offset);
+	return true;
+}
+
+/* marks the instructions of the method, returns false if it can not be translated */
+static bool reachMethod(VMContext *c, SobData *sob, uint32_t offset, uint8_t *reached, uint32_t *offsets) {
+	int count = 0;
+	offsets[count++] = offset;
+	reached[offset] = 1;
+	while (count != 0) {
+		VMInsn *insn = &sob->insns[offsets[--count]];
+		if (insn->op < 0xc0 && Insn_GetSize(insn->op, c->gameID) == 0) {
+			return false;
+		}
+		if (!insn->target && (insn->op == 0x02 || insn->op == 0x28 || insn->op == 0x29 || insn->op == 0xbc || insn->op == 0xbd)) {
+			return false;
+		}
+		int next[2];
+		const int next_count = Insn_GetSuccessors(sob, insn, next);
+		for (int i = 0; i < next_count; ++i) {
+			if (next[i] >= sob->code_size || sob->insns[next[i]].len == 0) {
+				return false;
+			}
+			if (!reached[next[i]]) {
+				reached[next[i]] = 1;
+				offsets[count++] = next[i];
+			}
+		}
+	}
+	return true;
+}
+
+static int translateClass(VMContext *c, FILE *fp, int num, SobData *sob, int *methods_count) {
+	uint8_t *translated = (uint8_t *)calloc(sob->code_size + 1, 2);
+	uint32_t *offsets = (uint32_t *)malloc((sob->code_size + 1) * sizeof(uint32_t));
+	if (!translated || !offsets) {
+		error("Failed to allocate translator for class '%s'", sob->class_name);
+	}
+	uint8_t *reached = translated + sob->code_size + 1;
+	int count = 0;
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		const SobCodeEntry *code = &sob->codeentries_data[i];
+		if (code->locals_offset == -1 || code->code_offset >= sob->code_size || code->class_handle != sob->class_handle) {
+			continue; /* inherited methods are translated with the parent class */
+		}
+		++*methods_count;
+		memset(reached, 0, sob->code_size + 1);
+		if (sob->insns[code->code_offset].len != 0 && reachMethod(c, sob, code->code_offset, reached, offsets)) {
+			for (int offset = 0; offset < sob->code_size; ++offset) {
+				translated[offset] |= reached[offset];
+			}
+			++count;
+		} else {
+			debug(DBG_VM, "Method at offset %d in class '%s' not translated", code->code_offset, sob->class_name);
+		}
+	}
+	if (count != 0) {
+		Translator t;
+		t.fp = fp;
+		t.sob = sob;
+		t.translated = translated;
+		fprintf(fp, "\n/* %s */\n", sob->class_name);
+		fprintf(fp, "static int translateClass%d(VMContext *c, VMScript *script, VMInsn *insns) {\n", num);
+		fprintf(fp, "\tVMVar *stack = c->stack;\n\tint sp = c->sp;\n\tVMVar *locals = script->local_vars;\n\t(void)locals;\n");
+		fprintf(fp, "\tswitch (c->code - insns) {\n");
+		for (int offset = 0; offset < sob->code_size; ++offset) {
+			if (translated[offset]) {
+				fprintf(fp, "\tcase %d: goto L%d;\n", offset, offset);
+			}
+		}
+		fprintf(fp, "\t}\n\treturn 0;\n");
+		int fallthrough = -1;
+		for (int offset = 0; offset < sob->code_size; ++offset) {
+			if (!translated[offset]) {
+				continue;
+			}
+			if (fallthrough != -1 && fallthrough != offset) {
+				writeGoto(&t, fallthrough);
+			}
+			fprintf(fp, "L%d:\n", offset);
+			fallthrough = writeInsn(&t, offset) ? (offset + sob->insns[offset].len) : -1;
+		}
+		if (fallthrough != -1) {
+			writeGoto(&t, fallthrough);
+		}
+		fprintf(fp, "}\n");
+	}
+	free(offsets);
+	free(translated);
+	return count;
+}
+
+/* loads all the classes of the game data, without running the static methods */
+void VM_WriteAot(VMContext *c, const char *path) {
+	c->load_only = 1;
+	for (int i = 0; i < Pan_GetAssetsCount(); ++i) {
+		const PanAsset *asset = Pan_GetAsset(i);
+		if (asset->type == PAN_ASSET_TYPE_SOB && asset->name) {
+			char name[64];
+			snprintf(name, sizeof(name), "%s", asset->name);
+			char *ext = strrchr(name, '.');
+			if (ext) {
+				*ext = 0;
+			}
+			VM_FindOrLoadClass(c, name, 0);
+		}
+	}
+	FILE *fp = fopen(path, "w");
+	if (!fp) {
+		error("Unable to open '%s' for writing", path);
+	}
+	fputs(_aotHeader, fp);
+	int methods_count = 0, translated_count = 0, classes_count = 0;
+	uint8_t *translated = (uint8_t *)calloc(c->classes_count, 1);
+	if (!translated) {
+		error("Failed to allocate %d classes", c->classes_count);
+	}
+	for (int i = 1; i < c->classes_count; ++i) {
+		SobData *sob = c->classes[i].sob_data;
+		if (sob && sob->insns) {
+			const int count = translateClass(c, fp, i, sob, &methods_count);
+			if (count != 0) {
+				translated[i] = 1;
+				translated_count += count;
+				++classes_count;
+			}
+		}
+	}
+	fprintf(fp, "\nstatic const VMAotClass _classes[] = {\n");
+	for (int i = 1; i < c->classes_count; ++i) {
+		const SobData *sob = c->classes[i].sob_data;
+		if (translated[i]) {
+			fprintf(fp, "\t{ \"%s\", %d, 0x%08x, translateClass%d },\n", sob->class_name, sob->code_size, hashClass(sob), i);
+		}
+	}
+	fprintf(fp, "};\n\n");
+	fprintf(fp, "const VMAotModule VM_AotModule = { VMAOT_VERSION, sizeof(VMContext), sizeof(VMScript), sizeof(VMInsn), %d, _classes };\n", classes_count);
+	fclose(fp);
+	free(translated);
+	debug(DBG_INFO, "Translated %d classes, %d/%d methods to '%s'", classes_count, translated_count, methods_count, path);
+}
@@ -2,30 +2,105 @@
 #include "random.h"
 #include "util.h"
 #include "vm.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ARRAY_GENERATIONS VMHANDLE_GENERATIONS(BASE_HANDLE_ARRAY, BASE_HANDLE_THREAD)
 
 VMArray *VM_GetArrayFromHandle(VMContext *c, int num) {
 	const int x = num - BASE_HANDLE_ARRAY;
-	if (x < 0 || x >= VMARRAYS_COUNT) {
-		error("Array handle %d out of range (%d..%d)", num, BASE_HANDLE_ARRAY, BASE_HANDLE_ARRAY + VMARRAYS_COUNT);
+	if (x < 0 || (x >> VMHANDLE_INDEX_BITS) >= ARRAY_GENERATIONS || (x & VMHANDLE_INDEX_MASK) >= c->arrays_capacity) {
+		error("Array handle %d out of range (%d..%d)", num, BASE_HANDLE_ARRAY, BASE_HANDLE_ARRAY + c->arrays_capacity);
+	}
+	VMArray *array = VM_GetArraySlot(c, x & VMHANDLE_INDEX_MASK);
+	if (array->handle != num) {
+		error("Array handle %d was deleted", num);
 	}
-	VMArray *array = &c->arrays[x];
-	assert(array->handle == num);
 	return array;
 }
 
+/* returns 0 if the value is not a live array handle */
+VMArray *ArrayHandle_Find(VMContext *c, uint32_t handle) {
+	const uint32_t x = handle - BASE_HANDLE_ARRAY;
+	if (x < (ARRAY_GENERATIONS << VMHANDLE_INDEX_BITS) && (x & VMHANDLE_INDEX_MASK) < c->arrays_capacity) {
+		VMArray *array = VM_GetArraySlot(c, x & VMHANDLE_INDEX_MASK);
+		if (array->handle == handle) {
+			return array;
+		}
+	}
+	return 0;
+}
+
+/* the context heap pointer is stored after the VMArrayInfo table of the chunk */
+static VMHeap **getChunkHeap(VMArray *chunk) {
+	return (VMHeap **)((VMArrayInfo *)(chunk + VMPOOL_CHUNK_SIZE) + VMPOOL_CHUNK_SIZE);
+}
+
+static VMHeap *getHeap(VMArray *array) {
+	return *getChunkHeap(array - array->slot);
+}
+
+static void freeArraySlot(VMContext *c, int num) {
+	VM_GetArraySlot(c, num)->next_free = 0;
+	if (c->arrays_free_tail != 0) {
+		VM_GetArraySlot(c, c->arrays_free_tail)->next_free = num;
+	} else {
+		c->arrays_next_free = num;
+	}
+	c->arrays_free_tail = num;
+}
+
+static void growArrays(VMContext *c) {
+	const int num = c->arrays_capacity;
+	VMArray *chunk = (VMArray *)calloc(1, VMPOOL_CHUNK_SIZE * (sizeof(VMArray) + sizeof(VMArrayInfo)) + sizeof(VMHeap *));
+	if (!chunk) {
+		error("Failed to allocate %d arrays", VMPOOL_CHUNK_SIZE);
+	}
+	*getChunkHeap(chunk) = c->heap;
+	c->arrays[num / VMPOOL_CHUNK_SIZE] = chunk;
+	for (int i = 0; i < VMPOOL_CHUNK_SIZE; ++i) {
+		chunk[i].slot = i;
+	}
+	c->arrays_capacity = num + VMPOOL_CHUNK_SIZE;
+	for (int i = (num == 0) ? 1 : 0; i < VMPOOL_CHUNK_SIZE; ++i) { /* slot 0 is the null handle */
+		freeArraySlot(c, num + i);
+	}
+	debug(DBG_VM, "Arrays pool capacity %d", c->arrays_capacity);
+}
+
 VMArray *Array_New(VMContext *c) {
-	assert(c->arrays_next_free != 0);
+	while (c->arrays_capacity - 1 - c->arrays_count < VMPOOL_MIN_FREE && c->arrays_capacity < (1 << VMHANDLE_INDEX_BITS)) {
+		growArrays(c);
+	}
+	if (c->arrays_next_free == 0) {
+		error("Too many arrays allocated (%d)", c->arrays_count);
+	}
 	const int num = c->arrays_next_free;
-	VMArray *array = &c->arrays[num];
+	VMArray *array = VM_GetArraySlot(c, num);
 	c->arrays_next_free = array->next_free;
+	if (c->arrays_next_free == 0) {
+		c->arrays_free_tail = 0;
+	}
+	const int generation = array->generation;
+	const int slot = array->slot;
 	memset(array, 0, sizeof(VMArray));
-	array->handle = BASE_HANDLE_ARRAY + num;
+	array->generation = generation;
+	array->slot = slot;
+	memset(Array_GetInfo(array), 0, sizeof(VMArrayInfo));
+	array->handle = BASE_HANDLE_ARRAY + ((generation << VMHANDLE_INDEX_BITS) | num);
+	array->gc_dirty = 1;
+	if (c->gc) {
+		VM_GCMarkNew(c, array->handle);
+	}
+	++c->arrays_count;
 	return array;
 }
 
 static void initArray(VMArray *array, int type) {
-	array->type = type;
-	array->struct_size = 0;
+	VMArrayInfo *info = Array_GetInfo(array);
+	info->type = type;
+	info->struct_size = 0;
 	int type2 = type;
 	if (type2 & 0x100) {
 		type2 &= ~0x100;
@@ -46,9 +121,9 @@ static void initArray(VMArray *array, int type) {
 			array->elem_size = 4;
 			break;
 		case VAR_TYPE_STRUCT:
-			array->struct_size = (type >> 20) & 0xFF;
-			assert(array->struct_size != 0);
-			array->elem_size = array->struct_size * 4;
+			info->struct_size = (type >> 20) & 0xFF;
+			assert(info->struct_size != 0);
+			array->elem_size = info->struct_size * 4;
 			break;
 		case VAR_TYPE_INT16:
 		case 11:
@@ -60,13 +135,34 @@ static void initArray(VMArray *array, int type) {
 	array->data = 0;
 	array->col_upper = -1;
 	array->col_lower = -1;
-	array->row_upper = -1;
-	array->row_lower = -1;
+	info->row_upper = -1;
+	info->row_lower = -1;
+	info->str_length = -1;
+	info->is_const = 0;
 	array->offset = 0;
 }
 
+/* small buffers are stored inline, spilling to the heap when the array grows */
+static uint8_t *allocData(VMArray *array, int size, int clear) {
+	uint8_t *p;
+	if (size <= VMARRAY_INLINE_SIZE) {
+		p = Array_GetInfo(array)->inline_data;
+		if (clear) {
+			memset(p, 0, size);
+		}
+	} else {
+		p = (uint8_t *)VM_HeapAlloc(getHeap(array), size, clear);
+	}
+	return p;
+}
+
+static int isHeapData(VMArray *array) {
+	VMArrayInfo *info = Array_GetInfo(array);
+	return !info->is_const && array->data != info->inline_data;
+}
+
 static void checkArrayTypeString(VMArray *array) {
-	if (array->type != VAR_TYPE_CHAR) {
+	if (Array_GetInfo(array)->type != VAR_TYPE_CHAR) {
 		error("Array %d is not a string", array->handle);
 	}
 }
@@ -76,7 +172,7 @@ void Array_Dim(VMArray *array, int type, int col_lower, int col_upper) {
 	array->col_upper = col_upper;
 	array->col_lower = col_lower;
 	const int size = col_upper - col_lower + 1;
-	array->data = (uint8_t *)calloc(size, array->elem_size);
+	array->data = allocData(array, size * array->elem_size, 1);
 	if (!array->data) {
 		error("Failed to allocate %d bytes in Array_Dim", size * array->elem_size);
 	}
@@ -84,80 +180,209 @@ void Array_Dim(VMArray *array, int type, int col_lower, int col_upper) {
 
 void Array_Dim2(VMArray *array, int type, int row_lower, int row_upper, int col_lower, int col_upper) {
 	initArray(array, type);
-	array->row_upper = row_upper;
+	VMArrayInfo *info = Array_GetInfo(array);
+	info->row_upper = row_upper;
 	array->col_upper = col_upper;
-	array->row_lower = row_lower;
+	info->row_lower = row_lower;
 	array->col_lower = col_lower;
-	array->dimension = 2;
+	info->dimension = 2;
 	const int size = (row_upper - row_lower + 1) * (col_upper - col_lower + 1);
-	array->data = (uint8_t *)calloc(size, array->elem_size);
+	array->data = allocData(array, size * array->elem_size, 1);
 	if (!array->data) {
 		error("Failed to allocate %d bytes in Array_Dim2", size * array->elem_size);
 	}
 }
 
-void Array_SetString(VMArray *array, const char *s) {
+void Array_SetStringBuffer(VMArray *array, const char *s, int len) {
 	initArray(array, VAR_TYPE_CHAR);
 	array->col_lower = 1;
-	array->dimension = 1;
-	array->col_upper = (strlen(s) + 1);
-	array->data = (uint8_t *)calloc(array->col_upper, array->elem_size);
+	VMArrayInfo *info = Array_GetInfo(array);
+	info->dimension = 1;
+	array->col_upper = len + 1;
+	array->data = allocData(array, array->col_upper, 0);
 	if (!array->data) {
-		error("Failed to allocate %d bytes in Array_SetString", array->col_upper * array->elem_size);
+		error("Failed to allocate %d bytes in Array_SetString", array->col_upper);
 	} else {
-		memcpy(array->data, s, array->col_upper);
+		memcpy(array->data, s, len);
+		array->data[len] = 0;
+		info->str_length = len;
 	}
 }
 
-int Array_Get(VMArray *array, int offset) {
-	if (array->is_key_value) {
-		for (int i = 0; i < array->kv_size; ++i) {
-			if (array->kv_data[i].key == offset) {
-				return array->kv_data[i].value;
+void Array_SetString(VMArray *array, const char *s) {
+	Array_SetStringBuffer(array, s, strlen(s));
+}
+
+/* the string is not copied, the SobData strings are kept until the context is freed */
+void Array_SetConstString(VMArray *array, const char *s, int len) {
+	initArray(array, VAR_TYPE_CHAR);
+	array->col_lower = 1;
+	array->col_upper = len + 1;
+	array->data = (uint8_t *)s;
+	VMArrayInfo *info = Array_GetInfo(array);
+	info->dimension = 1;
+	info->str_length = len;
+	info->is_const = 1;
+}
+
+static void copyConstString(VMArray *array) {
+	const int size = array->col_upper - array->col_lower + 1;
+	uint8_t *p = allocData(array, size, 0);
+	if (!p) {
+		error("Failed to allocate %d bytes in copyConstString", size);
+	}
+	memcpy(p, array->data + array->offset, size);
+	array->data = p;
+	array->offset = 0;
+	Array_GetInfo(array)->is_const = 0;
+}
+
+/* the key-value pairs are kept in insertion order, with an open addressing
+ * index of (pair number + 1) built once the array holds KV_INDEX_SIZE keys */
+#define KV_INDEX_SIZE 16
+
+static uint32_t hashKey(int key) {
+	const uint32_t h = key * 0x9E3779B1;
+	return h ^ (h >> 15);
+}
+
+static int findKey(const VMArrayInfo *info, int key) {
+	if (!info->kv_index) {
+		for (int i = 0; i < info->kv_size; ++i) {
+			if (info->kv_data[i].key == key) {
+				return i;
 			}
 		}
-		return 0;
+		return -1;
 	}
-	switch (array->elem_size) {
-	case 1:
-		return array->data[array->offset - array->col_lower + offset];
-	case 4:
-		return READ_LE_UINT32(array->data + (array->offset - array->col_lower + offset) * sizeof(uint32_t));
-	default:
-		error("Array %d data size (%d) is illegal", array->handle, array->elem_size);
+	for (uint32_t i = hashKey(key) & info->kv_mask; info->kv_index[i] != 0; i = (i + 1) & info->kv_mask) {
+		const int num = info->kv_index[i] - 1;
+		if (info->kv_data[num].key == key) {
+			return num;
+		}
+	}
+	return -1;
+}
+
+static void indexKey(VMArrayInfo *info, int num) {
+	uint32_t i = hashKey(info->kv_data[num].key) & info->kv_mask;
+	while (info->kv_index[i] != 0) {
+		i = (i + 1) & info->kv_mask;
+	}
+	info->kv_index[i] = num + 1;
+}
+
+static void growKeys(VMArray *array) {
+	VMHeap *heap = getHeap(array);
+	VMArrayInfo *info = Array_GetInfo(array);
+	const int capacity = (info->kv_capacity == 0) ? 4 : info->kv_capacity * 2;
+	info->kv_data = (struct vmarray_key_value_t *)VM_HeapRealloc(heap, info->kv_data, capacity * sizeof(struct vmarray_key_value_t));
+	if (!info->kv_data) {
+		error("Failed to allocate %d key-value pairs", capacity);
+	}
+	info->kv_capacity = capacity;
+	if (capacity >= KV_INDEX_SIZE) {
+		/* load factor is kept under 1/2 */
+		VM_HeapFree(heap, info->kv_index);
+		info->kv_index = (int *)VM_HeapAlloc(heap, capacity * 2 * sizeof(int), 1);
+		if (!info->kv_index) {
+			error("Failed to allocate %d key-value index", capacity * 2);
+		}
+		info->kv_mask = capacity * 2 - 1;
+		for (int i = 0; i < info->kv_size; ++i) {
+			indexKey(info, i);
+		}
 	}
+}
+
+int Array_Get(VMArray *array, int offset) {
+	if (array->is_key_value) {
+		const VMArrayInfo *info = Array_GetInfo(array);
+		const int num = findKey(info, offset);
+		return (num < 0) ? 0 : info->kv_data[num].value;
+	}
+	/* the buffers (heap or inline) are 4 bytes aligned */
+	const int index = array->offset - array->col_lower + offset;
+	if (array->elem_size == 4) {
+		return le32toh(((const uint32_t *)array->data)[index]);
+	} else if (array->elem_size == 1) {
+		return array->data[index];
+	}
+	error("Array %d data size (%d) is illegal", array->handle, array->elem_size);
 	return 0;
 }
 
 void Array_Set(VMArray *array, int offset, int value) {
+	array->gc_dirty = 1;
 	if (array->is_key_value) {
-		for (int i = 0; i < array->kv_size; ++i) {
-			if (array->kv_data[i].key == offset) {
-				array->kv_data[i].value = value;
-				return;
-			}
+		VMArrayInfo *info = Array_GetInfo(array);
+		const int num = findKey(info, offset);
+		if (num >= 0) {
+			info->kv_data[num].value = value;
+			return;
+		}
+		if (info->kv_size == info->kv_capacity) {
+			growKeys(array);
 		}
-		array->kv_data = (struct vmarray_key_value_t *)realloc(array->kv_data, (array->kv_size + 1) * sizeof(struct vmarray_key_value_t));
-		if (array->kv_data) {
-			array->kv_data[array->kv_size].key = offset;
-			array->kv_data[array->kv_size].value = value;
-			++array->kv_size;
+		info->kv_data[info->kv_size].key = offset;
+		info->kv_data[info->kv_size].value = value;
+		if (info->kv_index) {
+			indexKey(info, info->kv_size);
 		}
+		++info->kv_size;
 		return;
 	}
-	switch (array->elem_size) {
-	case 1:
-		array->data[array->offset - array->col_lower + offset] = value;
-		break;
-	case 4:
-		WRITE_LE_UINT32(array->data + (array->offset - array->col_lower + offset) * sizeof(uint32_t), value);
-		break;
-	default:
+	const int index = array->offset - array->col_lower + offset;
+	if (array->elem_size == 4) {
+		((uint32_t *)array->data)[index] = htole32(value);
+	} else if (array->elem_size == 1) {
+		VMArrayInfo *info = Array_GetInfo(array);
+		if (info->is_const) {
+			copyConstString(array);
+			array->data[offset - array->col_lower] = value;
+		} else {
+			array->data[index] = value;
+		}
+		info->str_length = -1;
+	} else {
 		error("Array %d data size (%d) is illegal", array->handle, array->elem_size);
 	}
 }
 
+static int findInt32(const uint32_t *p, int count, uint32_t value) {
+	int i = 0;
+#ifdef __SSE2__
+	const __m128i v = _mm_set1_epi32(value);
+	for (; i + 4 <= count; i += 4) {
+		const int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + i)), v));
+		if (mask != 0) {
+			return i + __builtin_ctz(mask) / 4;
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		if (p[i] == value) {
+			return i;
+		}
+	}
+	return -1;
+}
+
 int Array_Find(VMArray *array, int value) {
+	const int count = array->col_upper - array->col_lower + 1;
+	if (!array->is_key_value && count > 0) {
+		if (array->elem_size == 4) {
+			const int i = findInt32((const uint32_t *)array->data + array->offset, count, htole32(value));
+			return (i < 0) ? 0 : array->col_lower + i;
+		} else if (array->elem_size == 1) {
+			if (value < 0 || value > 255) {
+				return 0;
+			}
+			const uint8_t *p = array->data + array->offset;
+			const uint8_t *q = (const uint8_t *)memchr(p, value, count);
+			return q ? array->col_lower + (q - p) : 0;
+		}
+	}
 	for (int i = array->col_lower; i <= array->col_upper; ++i) {
 		if (Array_Get(array, i) == value) {
 			return i;
@@ -176,23 +401,29 @@ int Array_DeleteIndex(VMArray *array, int start, int end) {
 		end = array->col_upper;
 	}
 	const int count = end - start + 1;
-	for (int i = start; i + count <= array->col_upper; ++i) {
-		Array_Set(array, i, Array_Get(array, i + count));
+	if (count <= 0) {
+		return 1;
 	}
+	if (Array_GetInfo(array)->is_const) {
+		copyConstString(array);
+	}
+	uint8_t *p = array->data + ((int)array->offset - array->col_lower) * array->elem_size;
+	memmove(p + start * array->elem_size, p + (end + 1) * array->elem_size, (array->col_upper - end) * array->elem_size);
+	array->gc_dirty = 1;
 	array->col_upper -= count;
-	if (array->type == VAR_TYPE_CHAR) {
+	if (Array_GetInfo(array)->type == VAR_TYPE_CHAR) {
 		Array_Set(array, array->col_upper, 0);
 	}
 	return 1;
 }
 
 int Array_CheckIndex(VMArray *array, int index) {
-	return array->dimension != 2 && index >= array->col_lower && index <= array->col_upper;
+	return Array_GetInfo(array)->dimension != 2 && index >= array->col_lower && index <= array->col_upper;
 }
 
 static void initUnk28(VMArray *array, int before, int after) {
 	const int new_size = array->col_upper - array->col_lower + before;
-	uint8_t *p = (uint8_t *)calloc(array->elem_size, new_size + after + 1);
+	uint8_t *p = (uint8_t *)VM_HeapAlloc(getHeap(array), array->elem_size * (new_size + after + 1), 1);
 	if (!p) {
 		error("Failed to allocate Array.unk28 buffer");
 	} else {
@@ -202,26 +433,31 @@ static void initUnk28(VMArray *array, int before, int after) {
 		const int start_offset_in_bytes = array->elem_size * before;
 		uint8_t *prev = array->data;
 		memcpy(p + start_offset_in_bytes, array->data + offset_in_bytes, size_in_bytes);
-		array->data = p;
 		array->offset = before;
-		array->unk28 = after;
-		free(prev);
+		if (isHeapData(array)) {
+			VM_HeapFree(getHeap(array), prev);
+		}
+		array->data = p;
+		VMArrayInfo *info = Array_GetInfo(array);
+		info->unk28 = after;
+		info->is_const = 0;
 	}
 }
 
 void Array_InsertUpper(VMArray *array, int value) {
-	if (array->unk28 == 0) {
+	VMArrayInfo *info = Array_GetInfo(array);
+	if (info->unk28 == 0) {
 		initUnk28(array, 100, 100);
 	}
 	++array->col_upper;
-	--array->unk28;
-	if (array->type == VAR_TYPE_CHAR) {
+	--info->unk28;
+	if (info->type == VAR_TYPE_CHAR) {
 		Array_Set(array, array->col_upper - 1, value);
 		Array_Set(array, array->col_upper, 0);
 	} else {
 		Array_Set(array, array->col_upper, value);
 	}
-	assert(array->struct_size == 0);
+	assert(info->struct_size == 0);
 }
 
 int Array_DeleteLower(VMArray *array) {
@@ -230,54 +466,55 @@ int Array_DeleteLower(VMArray *array) {
 }
 
 int Array_DeleteUpper(VMArray *array) {
-	if (array->col_lower > array->col_upper || (array->type == VAR_TYPE_CHAR && array->col_lower == array->col_upper)) {
+	if (array->col_lower > array->col_upper || (Array_GetInfo(array)->type == VAR_TYPE_CHAR && array->col_lower == array->col_upper)) {
 		return 0;
 	}
 	const int value = Array_Get(array, array->col_upper);
 	Array_Set(array, array->col_upper, 0);
 	--array->col_upper;
-	++array->unk28;
+	++Array_GetInfo(array)->unk28;
 	return value;
 }
 
 int Array_GetStringLength(VMArray *array) {
-	if (array->type != VAR_TYPE_CHAR) {
+	VMArrayInfo *info = Array_GetInfo(array);
+	if (info->type != VAR_TYPE_CHAR) {
 		error("Can't do string operations on non-string array %d", array->handle);
-	} else if (array->dimension == 2) {
+	} else if (info->dimension == 2) {
 		error("Accessing [n,n] as [n]");
 	} else {
 		assert(array->is_key_value == 0);
-		int len = 0;
-		for (int i = array->col_lower; i <= array->col_upper; ++i) {
-			if (Array_Get(array, i) == 0) {
-				return len;
+		if (info->str_length < 0) {
+			const uint8_t *p = array->data + array->offset;
+			const uint8_t *q = (const uint8_t *)memchr(p, 0, array->col_upper - array->col_lower + 1);
+			if (!q) {
+				error("No EOS on string %d", array->handle);
 			}
-			++len;
+			info->str_length = q - p;
 		}
-		error("No EOS on string %d", array->handle);
+		return info->str_length;
 	}
 	return 0;
 }
 
 int Array_Copy1(VMContext *c, VMArray *array) {
-	if (array->dimension == 1) {
+	const VMArrayInfo *info = Array_GetInfo(array);
+	if (info->dimension == 1) {
 		VMArray *array2 = Array_New(c);
-		const int lower = array->col_lower;
-		const int upper = array->col_upper;
-		Array_Dim(array2, array->type, 1, upper - lower + 1);
-		for (int x = lower; x <= upper; ++x) {
-			const int val = Array_Get(array, x);
-			Array_Set(array2, x, val);
+		const int count = array->col_upper - array->col_lower + 1;
+		Array_Dim(array2, info->type, 1, count);
+		if (count > 0) {
+			memcpy(array2->data, array->data + array->offset * array->elem_size, count * array->elem_size);
 		}
 		return array2->handle;
 	} else {
-		error("Array_Copy1 unimplemented dimension:%d", array->dimension);
+		error("Array_Copy1 unimplemented dimension:%d", info->dimension);
 	}
 	return array->handle;
 }
 
 int Array_Range1(VMContext *c, VMArray *array, int start, int end) {
-	if (array->dimension == 2) {
+	if (Array_GetInfo(array)->dimension == 2) {
 		error("Accessing [n,n] as [n]");
 	}
 	assert(start <= end);
@@ -290,29 +527,29 @@ int Array_Range1(VMContext *c, VMArray *array, int start, int end) {
 		upper = array->col_upper;
 	}
 	VMArray *array2 = Array_New(c);
-	Array_Dim(array2, array->type, 1, upper - lower + 1);
-	for (int x = lower; x <= upper; ++x) {
-		const int val = Array_Get(array, x);
-		Array_Set(array2, x - lower + 1, val);
+	Array_Dim(array2, Array_GetInfo(array)->type, 1, upper - lower + 1);
+	if (upper >= lower) {
+		memcpy(array2->data, array->data + (array->offset + lower - array->col_lower) * array->elem_size, (upper - lower + 1) * array->elem_size);
 	}
 	return array2->handle;
 }
 
 int Array_Rand(VMArray *array) {
+	VMArrayInfo *info = Array_GetInfo(array);
 	int lower = array->col_lower;
 	int upper = array->col_upper;
-	if (array->type == VAR_TYPE_CHAR) {
+	if (info->type == VAR_TYPE_CHAR) {
 		--upper;
 	}
 	int x = GetRandomNumber(lower, upper);
-	if (x == array->unk40) {
+	if (x == info->unk40) {
 		++x;
 		if (x > upper) {
 			x = upper;
 		}
 	}
-	array->unk40 = x;
-	assert(array->struct_size == 0);
+	info->unk40 = x;
+	assert(info->struct_size == 0);
 	return Array_Get(array, x);
 }
 
@@ -328,6 +565,10 @@ int ArrayHandle_CompareString(VMContext *c, int array1, int array2) {
 	checkArrayTypeString(a2);
 	const char *s1 = (const char *)a1->data + a1->offset;
 	const char *s2 = (const char *)a2->data + a2->offset;
+	if (s1 == s2) {
+		/* constant strings pushed from the same SobData string */
+		return 0;
+	}
 	return strcmp(s1, s2);
 }
 
@@ -337,12 +578,21 @@ void ArrayHandle_ConcatString(VMContext *c, int array1, int array2) {
 	VMArray *a2 = VM_GetArrayFromHandle(c, array2);
 	checkArrayTypeString(a2);
 	const int len = Array_GetStringLength(a2);
-	initUnk28(a1, 0, len);
-	const uint8_t *src = a2->data + a2->offset * a2->elem_size;
-	uint8_t *dst = a1->data + (a1->offset + a1->col_upper - 1) * a1->elem_size;
-	memcpy(dst, src, len * a1->elem_size);
+	VMArrayInfo *info = Array_GetInfo(a1);
+	const int size = a1->col_upper - a1->col_lower + 1;
+	/* the string is known to end at col_upper, its length is updated */
+	const int str_length = (info->str_length == size - 1) ? info->str_length + len : -1;
+	if (info->unk28 < len || info->is_const) {
+		/* the headroom after the string is doubled */
+		initUnk28(a1, 0, (len > size) ? len : size);
+	}
+	const uint8_t *src = a2->data + a2->offset;
+	uint8_t *dst = a1->data + a1->offset + size - 1;
+	memcpy(dst, src, len);
+	dst[len] = 0;
 	a1->col_upper += len;
-	a1->unk28 -= len;
+	info->unk28 -= len;
+	info->str_length = str_length;
 }
 
 int ArrayHandle_AddString(VMContext *c, int array1, int array2) {
@@ -354,23 +604,18 @@ int ArrayHandle_AddString(VMContext *c, int array1, int array2) {
 	const int s2_len = Array_GetStringLength(a2);
 	VMArray *array = Array_New(c);
 	Array_Dim(array, VAR_TYPE_CHAR, 1, s1_len + s2_len + 1);
-	int x = array->col_lower;
-	assert(a1->is_key_value == 0);
-	for (int i = a1->col_lower; i < a1->col_upper; ++i) {
-		const int val = Array_Get(a1, i);
-		Array_Set(array, x++, val);
-	}
-	for (int i = a2->col_lower; i < a2->col_upper; ++i) {
-		const int val = Array_Get(a2, i);
-		Array_Set(array, x++, val);
-	}
-	Array_Set(array, x, 0);
+	memcpy(array->data, a1->data + a1->offset, s1_len);
+	memcpy(array->data + s1_len, a2->data + a2->offset, s2_len);
+	Array_GetInfo(array)->str_length = s1_len + s2_len;
 	return array->handle;
 }
 
 void ArrayHandle_LowerString(VMContext *c, int array) {
 	VMArray *a = VM_GetArrayFromHandle(c, array);
 	checkArrayTypeString(a);
+	if (Array_GetInfo(a)->is_const) {
+		copyConstString(a);
+	}
 	for (char *p = (char *)a->data + a->offset; *p; ++p) {
 		if (*p >= 'A' && *p <= 'Z') {
 			*p += 'a' - 'A';
@@ -381,6 +626,9 @@ void ArrayHandle_LowerString(VMContext *c, int array) {
 void ArrayHandle_UpperString(VMContext *c, int array) {
 	VMArray *a = VM_GetArrayFromHandle(c, array);
 	checkArrayTypeString(a);
+	if (Array_GetInfo(a)->is_const) {
+		copyConstString(a);
+	}
 	for (char *p = (char *)a->data + a->offset; *p; ++p) {
 		if (*p >= 'a' && *p <= 'z') {
 			*p += 'A' - 'a';
@@ -388,11 +636,26 @@ void ArrayHandle_UpperString(VMContext *c, int array) {
 	}
 }
 
+static void freeArray(VMArray *array) {
+	VMHeap *heap = getHeap(array);
+	if (isHeapData(array)) {
+		VM_HeapFree(heap, array->data);
+	}
+	VMArrayInfo *info = Array_GetInfo(array);
+	VM_HeapFree(heap, info->kv_data);
+	VM_HeapFree(heap, info->kv_index);
+}
+
 void ArrayHandle_Delete(VMContext *c, int array) {
 	if (array != 0) {
 		VMArray *a = VM_GetArrayFromHandle(c, array);
-		free(a->data);
-		a->next_free = c->arrays_next_free;
-		c->arrays_next_free = a - c->arrays;
+		freeArray(a);
+		const int generation = (a->generation + 1) % ARRAY_GENERATIONS;
+		const int slot = a->slot;
+		memset(a, 0, sizeof(VMArray));
+		a->generation = generation;
+		a->slot = slot;
+		freeArraySlot(c, (array - BASE_HANDLE_ARRAY) & VMHANDLE_INDEX_MASK);
+		--c->arrays_count;
 	}
 }
@@ -0,0 +1,270 @@
+#include "util.h"
+#include "vm.h"
+
+/* incremental cycles are started when a pool is more than 3/4 full */
+#define GC_PRESSURE(count, size) ((count) > (size) - (size) / 4)
+
+/* the timer is only read every N traced handles */
+#define GC_TIMER_STEP 64
+
+/* the marks cover the pools capacity when the cycle started, the slots
+ * added afterwards are only used by allocations made during the cycle */
+struct vmgc_t {
+	int arrays_size, objects_size;
+	uint8_t *arrays;
+	uint8_t *objects;
+	int count;
+	uint32_t *handles;
+	int steps;
+	uint32_t max_step_us;
+};
+
+static VMGC *allocMarks(VMContext *c) {
+	const int count = c->arrays_capacity + c->objects_capacity;
+	VMGC *m = (VMGC *)calloc(1, sizeof(VMGC) + count * (sizeof(uint32_t) + 1));
+	if (!m) {
+		warning("Failed to allocate GC marks");
+		return 0;
+	}
+	m->arrays_size = c->arrays_capacity;
+	m->objects_size = c->objects_capacity;
+	m->handles = (uint32_t *)(m + 1);
+	m->arrays = (uint8_t *)(m->handles + count);
+	m->objects = m->arrays + m->arrays_size;
+	return m;
+}
+
+/* values are scanned conservatively, anything matching a live handle is kept */
+static void markHandle(VMContext *c, VMGC *m, uint32_t value) {
+	if (value >= BASE_HANDLE_ARRAY && value < BASE_HANDLE_THREAD) {
+		const int num = (value - BASE_HANDLE_ARRAY) & VMHANDLE_INDEX_MASK;
+		if (num < m->arrays_size && !m->arrays[num] && ArrayHandle_Find(c, value)) {
+			m->arrays[num] = 1;
+			m->handles[m->count++] = value;
+		}
+	} else if (value >= BASE_HANDLE_OBJECT && value < BASE_HANDLE_ARRAY) {
+		const int num = (value - BASE_HANDLE_OBJECT) & VMHANDLE_INDEX_MASK;
+		if (num < m->objects_size && !m->objects[num] && ObjectHandle_Find(c, value)) {
+			m->objects[num] = 1;
+			m->handles[m->count++] = value;
+		}
+	}
+}
+
+static void markVars(VMContext *c, VMGC *m, const VMVar *vars, int count) {
+	for (int i = 0; i < count; ++i) {
+		markHandle(c, m, vars[i].value);
+	}
+}
+
+static void markScript(VMContext *c, VMGC *m, const VMScript *script) {
+	for (; script; script = script->next_script) {
+		markHandle(c, m, script->obj_handle);
+		if (script->local_vars) {
+			markVars(c, m, script->local_vars, script->local_vars_count);
+		}
+	}
+}
+
+static void traceArray(VMContext *c, VMGC *m, VMArray *array) {
+	array->gc_dirty = 0;
+	const VMArrayInfo *info = Array_GetInfo(array);
+	if (array->is_key_value) {
+		for (int i = 0; i < info->kv_size; ++i) {
+			markHandle(c, m, info->kv_data[i].key);
+			markHandle(c, m, info->kv_data[i].value);
+		}
+		return;
+	}
+	if (!array->data || (array->elem_size & 3) != 0) {
+		return;
+	}
+	int count = array->col_upper - array->col_lower + 1;
+	if (info->dimension == 2) {
+		count *= info->row_upper - info->row_lower + 1;
+	}
+	const uint8_t *p = array->data + array->offset * array->elem_size;
+	for (int i = 0; i < count * array->elem_size; i += 4) {
+		markHandle(c, m, READ_LE_UINT32(p + i));
+	}
+}
+
+static void traceObject(VMContext *c, VMGC *m, VMObject *obj) {
+	obj->gc_dirty = 0;
+	if (obj->members) {
+		markVars(c, m, obj->members, obj->members_count + 1);
+	}
+}
+
+/* a handle may have been deleted since it was grayed */
+static void traceHandle(VMContext *c, VMGC *m, uint32_t handle) {
+	if (handle >= BASE_HANDLE_ARRAY) {
+		VMArray *array = ArrayHandle_Find(c, handle);
+		if (array) {
+			traceArray(c, m, array);
+		}
+	} else {
+		VMObject *obj = ObjectHandle_Find(c, handle);
+		if (obj) {
+			traceObject(c, m, obj);
+		}
+	}
+}
+
+static void markRoots(VMContext *c, VMGC *m) {
+	markVars(c, m, c->stack, c->sp);
+	if (c->frames) {
+		markVars(c, m, c->frames, c->frames_top);
+	}
+	markScript(c, m, c->script);
+	for (const VMThread *thread = c->threads_head; thread; thread = thread->next) {
+		markScript(c, m, thread->script);
+	}
+	for (int i = 1; i < c->classes_count; ++i) {
+		const SobData *sob = c->classes[i].sob_data;
+		if (sob) {
+			for (int j = 1; j <= sob->staticvars_count; ++j) {
+				markHandle(c, m, sob->staticvars_data[j].value);
+			}
+		}
+	}
+}
+
+static void drain(VMContext *c, VMGC *m) {
+	while (m->count != 0) {
+		traceHandle(c, m, m->handles[--m->count]);
+	}
+}
+
+/* the roots and the statics have no write barrier, they are scanned again
+ * along with the black arrays and objects written during the cycle */
+static void remark(VMContext *c, VMGC *m) {
+	markRoots(c, m);
+	for (int i = 1; i < c->arrays_capacity; ++i) {
+		VMArray *array = VM_GetArraySlot(c, i);
+		if (array->gc_dirty && array->handle != 0 && (i >= m->arrays_size || m->arrays[i])) {
+			traceArray(c, m, array);
+		}
+	}
+	for (int i = 1; i < c->objects_capacity; ++i) {
+		VMObject *obj = VM_GetObjectSlot(c, i);
+		if (obj->gc_dirty && obj->handle != 0 && (i >= m->objects_size || m->objects[i])) {
+			traceObject(c, m, obj);
+		}
+	}
+	drain(c, m);
+}
+
+static int sweep(VMContext *c, VMGC *m, int *arrays_count, int *objects_count) {
+	*arrays_count = 0;
+	for (int i = 1; i < m->arrays_size; ++i) {
+		const uint32_t handle = VM_GetArraySlot(c, i)->handle;
+		if (handle != 0 && !m->arrays[i]) {
+			ArrayHandle_Delete(c, handle);
+			++*arrays_count;
+		}
+	}
+	*objects_count = 0;
+	for (int i = 1; i < m->objects_size; ++i) {
+		const uint32_t handle = VM_GetObjectSlot(c, i)->handle;
+		if (handle != 0 && !m->objects[i]) {
+			ObjectHandle_Delete(c, handle, 0);
+			++*objects_count;
+		}
+	}
+	return *arrays_count + *objects_count;
+}
+
+static uint32_t getTimerUs(VMContext *c) {
+	return c->get_timer_us ? (*c->get_timer_us)() : 0;
+}
+
+int VM_GC(VMContext *c, int flag) {
+	const uint32_t start = getTimerUs(c);
+	if (c->gc) { /* the pending incremental cycle is restarted from scratch */
+		free(c->gc);
+		c->gc = 0;
+	}
+	VMGC *m = allocMarks(c);
+	if (!m) {
+		return 0;
+	}
+	markRoots(c, m);
+	drain(c, m);
+	int arrays_count, objects_count;
+	const int count = sweep(c, m, &arrays_count, &objects_count);
+	free(m);
+	const uint32_t end = getTimerUs(c);
+	debug(DBG_GC, "GC flag:%d freed %d arrays %d objects in %d us", flag, arrays_count, objects_count, end - start);
+	return count;
+}
+
+static bool startCycle(VMContext *c) {
+	const bool periodic = c->gc_counter > 0 && (c->frame_counter % c->gc_counter) == 0;
+	if (!periodic && !GC_PRESSURE(c->arrays_count, c->arrays_capacity) && !GC_PRESSURE(c->objects_count, c->objects_capacity)) {
+		return false;
+	}
+	VMGC *m = allocMarks(c);
+	if (!m) {
+		return false;
+	}
+	for (int i = 1; i < c->arrays_capacity; ++i) {
+		VM_GetArraySlot(c, i)->gc_dirty = 0;
+	}
+	for (int i = 1; i < c->objects_capacity; ++i) {
+		VM_GetObjectSlot(c, i)->gc_dirty = 0;
+	}
+	markRoots(c, m);
+	c->gc = m;
+	return true;
+}
+
+void VM_GCStep(VMContext *c) {
+	if (c->gc_budget_us <= 0 || !c->get_timer_us) {
+		return;
+	}
+	const uint32_t start = getTimerUs(c);
+	if (!c->gc && !startCycle(c)) {
+		return;
+	}
+	VMGC *m = c->gc;
+	++m->steps;
+	for (int i = 1; m->count != 0; ++i) {
+		traceHandle(c, m, m->handles[--m->count]);
+		if ((i % GC_TIMER_STEP) == 0) {
+			const uint32_t elapsed = getTimerUs(c) - start;
+			if (elapsed >= (uint32_t)c->gc_budget_us) {
+				if (m->max_step_us < elapsed) {
+					m->max_step_us = elapsed;
+				}
+				return;
+			}
+		}
+	}
+	remark(c, m);
+	int arrays_count, objects_count;
+	sweep(c, m, &arrays_count, &objects_count);
+	const uint32_t elapsed = getTimerUs(c) - start;
+	if (m->max_step_us < elapsed) {
+		m->max_step_us = elapsed;
+	}
+	debug(DBG_GC, "GC incremental freed %d arrays %d objects in %d steps, max step %d us", arrays_count, objects_count, m->steps, m->max_step_us);
+	free(m);
+	c->gc = 0;
+}
+
+/* allocated black during a cycle, the contents are traced by the remark */
+void VM_GCMarkNew(VMContext *c, uint32_t handle) {
+	VMGC *m = c->gc;
+	if (handle >= BASE_HANDLE_ARRAY) {
+		const int num = (handle - BASE_HANDLE_ARRAY) & VMHANDLE_INDEX_MASK;
+		if (num < m->arrays_size) {
+			m->arrays[num] = 1;
+		}
+	} else {
+		const int num = (handle - BASE_HANDLE_OBJECT) & VMHANDLE_INDEX_MASK;
+		if (num < m->objects_size) {
+			m->objects[num] = 1;
+		}
+	}
+}
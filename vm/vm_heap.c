@@ -0,0 +1,183 @@
+#include "util.h"
+#include "vm.h"
+
+/* the blocks are carved from slabs dedicated to a power-of-two size class,
+ * the larger blocks are allocated with malloc and linked in a list */
+#define HEAP_MIN_SHIFT  4
+#define HEAP_SLAB_SIZE  (64 * 1024)
+#define HEAP_LARGE      VMHEAP_CLASSES
+
+typedef struct {
+	uint32_t size; /* requested size */
+	uint32_t size_class;
+} HeapBlock;
+
+typedef struct heaplarge_t {
+	struct heaplarge_t *prev, *next;
+	HeapBlock block;
+} HeapLarge;
+
+typedef struct heapslab_t {
+	struct heapslab_t *next;
+	uint64_t align;
+} HeapSlab;
+
+typedef struct heapfree_t {
+	struct heapfree_t *next;
+} HeapFree;
+
+struct vmheap_t {
+	HeapFree *free_blocks[VMHEAP_CLASSES];
+	uint8_t *slab_ptr[VMHEAP_CLASSES];
+	uint8_t *slab_end[VMHEAP_CLASSES];
+	HeapSlab *slabs;
+	HeapLarge *large;
+	VMHeapStats stats[VMHEAP_CLASSES + 1];
+};
+
+VMHeap *VM_NewHeap() {
+	VMHeap *heap = (VMHeap *)calloc(1, sizeof(VMHeap));
+	if (!heap) {
+		error("Failed to allocate VM heap");
+	}
+	for (int i = 0; i < VMHEAP_CLASSES; ++i) {
+		heap->stats[i].block_size = 1 << (HEAP_MIN_SHIFT + i);
+	}
+	return heap;
+}
+
+void VM_FreeHeap(VMHeap *heap) {
+	if (heap) {
+		while (heap->slabs) {
+			HeapSlab *next = heap->slabs->next;
+			free(heap->slabs);
+			heap->slabs = next;
+		}
+		while (heap->large) {
+			HeapLarge *next = heap->large->next;
+			free(heap->large);
+			heap->large = next;
+		}
+		free(heap);
+	}
+}
+
+static int getSizeClass(int size) {
+	int num = 0;
+	while ((1 << (HEAP_MIN_SHIFT + num)) < size) {
+		++num;
+	}
+	return num;
+}
+
+static uint8_t *allocSlabBlock(VMHeap *heap, int num) {
+	const int block_size = 1 << (HEAP_MIN_SHIFT + num);
+	if (heap->slab_ptr[num] + block_size > heap->slab_end[num]) {
+		HeapSlab *slab = (HeapSlab *)malloc(HEAP_SLAB_SIZE);
+		if (!slab) {
+			error("Failed to allocate %d bytes heap slab", HEAP_SLAB_SIZE);
+		}
+		slab->next = heap->slabs;
+		heap->slabs = slab;
+		heap->slab_ptr[num] = (uint8_t *)(slab + 1);
+		heap->slab_end[num] = (uint8_t *)slab + HEAP_SLAB_SIZE;
+		heap->stats[num].slabs_bytes += HEAP_SLAB_SIZE;
+	}
+	uint8_t *p = heap->slab_ptr[num];
+	heap->slab_ptr[num] += block_size;
+	return p;
+}
+
+static void addStats(VMHeapStats *stats, int size, int block_size) {
+	++stats->count;
+	stats->live_bytes += block_size;
+	stats->wasted_bytes += block_size - size;
+	if (stats->live_bytes > stats->peak_bytes) {
+		stats->peak_bytes = stats->live_bytes;
+	}
+}
+
+static void removeStats(VMHeapStats *stats, int size, int block_size) {
+	--stats->count;
+	stats->live_bytes -= block_size;
+	stats->wasted_bytes -= block_size - size;
+}
+
+void *VM_HeapAlloc(VMHeap *heap, int size, int clear) {
+	const int total = sizeof(HeapBlock) + size;
+	HeapBlock *block;
+	if (total <= (1 << (HEAP_MIN_SHIFT + VMHEAP_CLASSES - 1))) {
+		const int num = getSizeClass(total);
+		if (heap->free_blocks[num]) {
+			block = (HeapBlock *)heap->free_blocks[num];
+			heap->free_blocks[num] = heap->free_blocks[num]->next;
+		} else {
+			block = (HeapBlock *)allocSlabBlock(heap, num);
+		}
+		block->size_class = num;
+		addStats(&heap->stats[num], total, 1 << (HEAP_MIN_SHIFT + num));
+	} else {
+		HeapLarge *large = (HeapLarge *)malloc(sizeof(HeapLarge) + size);
+		if (!large) {
+			return 0;
+		}
+		large->prev = 0;
+		large->next = heap->large;
+		if (heap->large) {
+			heap->large->prev = large;
+		}
+		heap->large = large;
+		block = &large->block;
+		block->size_class = HEAP_LARGE;
+		addStats(&heap->stats[HEAP_LARGE], size, sizeof(HeapLarge) + size);
+	}
+	block->size = size;
+	if (clear) {
+		memset(block + 1, 0, size);
+	}
+	return block + 1;
+}
+
+void VM_HeapFree(VMHeap *heap, void *p) {
+	if (p) {
+		HeapBlock *block = (HeapBlock *)p - 1;
+		const int num = block->size_class;
+		if (num == HEAP_LARGE) {
+			removeStats(&heap->stats[num], block->size, sizeof(HeapLarge) + block->size);
+			HeapLarge *large = (HeapLarge *)((uint8_t *)p - sizeof(HeapLarge));
+			if (large->prev) {
+				large->prev->next = large->next;
+			} else {
+				heap->large = large->next;
+			}
+			if (large->next) {
+				large->next->prev = large->prev;
+			}
+			free(large);
+		} else {
+			removeStats(&heap->stats[num], sizeof(HeapBlock) + block->size, 1 << (HEAP_MIN_SHIFT + num));
+			HeapFree *f = (HeapFree *)block;
+			f->next = heap->free_blocks[num];
+			heap->free_blocks[num] = f;
+		}
+	}
+}
+
+void *VM_HeapRealloc(VMHeap *heap, void *p, int size) {
+	void *q = VM_HeapAlloc(heap, size, 0);
+	if (q && p) {
+		const int prev_size = ((HeapBlock *)p - 1)->size;
+		memcpy(q, p, (prev_size < size) ? prev_size : size);
+		VM_HeapFree(heap, p);
+	}
+	return q;
+}
+
+void VM_DumpHeapStats(VMHeap *heap) {
+	for (int i = 0; i <= VMHEAP_CLASSES; ++i) {
+		const VMHeapStats *stats = &heap->stats[i];
+		if (stats->peak_bytes != 0) {
+			debug(DBG_HEAP, "Heap class %5d: count %d live %d wasted %d peak %d slabs %d", stats->block_size, stats->count, stats->live_bytes, stats->wasted_bytes, stats->peak_bytes, stats->slabs_bytes);
+		}
+	}
+}
@@ -0,0 +1,294 @@
+
+#include "util.h"
+#include "vm.h"
+
+/* opcode sizes in bytes including operands, 0 for unknown opcodes */
+static const uint8_t _opcodesSize[256] = {
+	[0x01] = 1, [0x02] = 5, [0x04] = 1, [0x05] = 1, [0x06] = 2, [0x07] = 5,
+	[0x08] = 5, [0x09] = 5, [0x0a] = 5, [0x0b] = 5, [0x0c] = 5, [0x0d] = 1,
+	[0x0e] = 5, [0x0f] = 5, [0x10] = 5, [0x11] = 5, [0x12] = 5, [0x13] = 5,
+	[0x14] = 5, [0x15] = 5, [0x17] = 5, [0x18] = 1, [0x19] = 1, [0x1a] = 1,
+	[0x1b] = 1, [0x1c] = 1, [0x1e] = 6, [0x20] = 6, [0x21] = 6, [0x28] = 5,
+	[0x29] = 5, [0x2a] = 1, [0x2b] = 1, [0x2c] = 1, [0x2d] = 1, [0x2e] = 1,
+	[0x2f] = 1, [0x30] = 1, [0x31] = 1, [0x32] = 5, [0x33] = 5, [0x34] = 5,
+	[0x35] = 5, [0x36] = 5, [0x37] = 5, [0x38] = 5, [0x3a] = 5, [0x3b] = 5,
+	[0x3c] = 5, [0x3d] = 1, [0x3e] = 5, [0x3f] = 5, [0x40] = 1, [0x41] = 1,
+	[0x42] = 1, [0x43] = 1, [0x44] = 1, [0x45] = 1, [0x46] = 1, [0x47] = 1,
+	[0x48] = 1, [0x4a] = 1, [0x4b] = 1, [0x4c] = 1, [0x4d] = 1, [0x5b] = 1,
+	[0x5c] = 1, [0x5d] = 1, [0x61] = 1, [0x62] = 1, [0x63] = 1, [0x64] = 1,
+	[0x65] = 1, [0x66] = 1, [0x67] = 1, [0x68] = 1, [0x69] = 1, [0x6c] = 1,
+	[0x6d] = 1, [0x70] = 1, [0x71] = 1, [0x72] = 1, [0x73] = 5, [0x74] = 1,
+	[0x75] = 1, [0x76] = 1, [0x77] = 1, [0x78] = 1, [0x79] = 1, [0x7a] = 1,
+	[0x7b] = 1, [0x7c] = 1, [0x7d] = 1, [0x7e] = 1, [0x7f] = 1, [0x80] = 1,
+	[0x86] = 1, [0x87] = 1, [0x8c] = 5, [0x8e] = 1, [0x8f] = 5, [0x90] = 6,
+	[0x91] = 1, [0x92] = 1, [0x93] = 1, [0x94] = 1, [0x95] = 1, [0x96] = 1,
+	[0x97] = 1, [0xa5] = 1, [0xab] = 1, [0xad] = 1, [0xae] = 1, [0xaf] = 1,
+	[0xb0] = 5, [0xb1] = 1, [0xb2] = 1, [0xb5] = 1, [0xb6] = 5, [0xb7] = 5,
+	[0xb8] = 5, [0xb9] = 1, [0xba] = 1, [0xbc] = 5, [0xbd] = 5,
+};
+
+int Insn_GetSize(int op, int gameID) {
+	if (op == 0x61 && gameID >= GID_MONSTERS) { /* op_poppush_array has the array type */
+		return 5;
+	}
+	return _opcodesSize[op & 0xFF];
+}
+
+typedef struct {
+	uint32_t *data;
+	int count, size;
+} Worklist;
+
+static void pushOffset(Worklist *w, uint32_t offset) {
+	if (w->count == w->size) {
+		w->size = w->size ? w->size * 2 : 64;
+		w->data = (uint32_t *)realloc(w->data, w->size * sizeof(uint32_t));
+		if (!w->data) {
+			error("Failed to allocate %d decode offsets", w->size);
+		}
+	}
+	w->data[w->count++] = offset;
+}
+
+static void *allocCache(SobData *sob, int size) {
+	void *cache = calloc(1, size);
+	if (!cache) {
+		error("Failed to allocate inline cache for class '%s'", sob->class_name);
+	}
+	if ((sob->caches_count & 63) == 0) {
+		sob->caches_data = (void **)realloc(sob->caches_data, (sob->caches_count + 64) * sizeof(void *));
+		if (!sob->caches_data) {
+			error("Failed to allocate %d inline caches for class '%s'", sob->caches_count + 64, sob->class_name);
+		}
+	}
+	sob->caches_data[sob->caches_count++] = cache;
+	return cache;
+}
+
+static bool setTarget(SobData *sob, VMInsn *insn, uint32_t offset, Worklist *w) {
+	const int32_t target = offset + insn->num;
+	if (target < 0 || target >= sob->code_size) {
+		insn->target = 0; /* checked when the jump is taken */
+		return false;
+	}
+	insn->target = &sob->insns[target];
+	pushOffset(w, target);
+	return true;
+}
+
+/* returns false when the execution does not continue with the next instruction */
+static bool decodeInsn(VMContext *c, SobData *sob, uint32_t offset, Worklist *w) {
+	VMInsn *insn = &sob->insns[offset];
+	const uint8_t *p = sob->code_data + offset;
+	insn->op = p[0];
+	const int size = Insn_GetSize(insn->op, c->gameID);
+	if (size == 0) {
+		insn->len = 1; /* unimplemented, raises an error when executed */
+		return false;
+	}
+	if (offset + size > sob->code_size) {
+		error("Truncated opcode 0x%02x at offset %d in class '%s'", insn->op, offset, sob->class_name);
+	}
+	insn->len = size;
+	insn->count = 1;
+	switch (size) {
+	case 2:
+		insn->num = p[1];
+		break;
+	case 5:
+		insn->num = READ_LE_UINT32(p + 1);
+		break;
+	case 6:
+		insn->type = p[1];
+		insn->num = READ_LE_UINT32(p + 2);
+		break;
+	}
+	switch (insn->op) {
+	case 0x02: /* op_jump */
+		setTarget(sob, insn, offset, w);
+		return false;
+	case 0x04: /* op_return */
+	case 0x05:
+	case 0x41: /* op_quit */
+		return false;
+	case 0x08: /* op_push_local */
+	case 0x0b: /* op_push_static_me */
+	case 0x0c: /* op_push_static */
+	case 0x0e: /* op_pop_local */
+	case 0x11: /* op_pop_static_me */
+	case 0x12: /* op_pop_static */
+	case 0x3b: /* op_pop_static_array */
+		if (insn->num & 0xFFFF0000) {
+			assert((insn->num & 0xFF000000) == 0);
+			insn->count = (insn->num >> 16) & 0xFF;
+		}
+		break;
+	case 0x09: /* op_push_me */
+	case 0x0a: /* op_push_member */
+	case 0x0f: /* op_pop_me */
+	case 0x10: /* op_pop_member */
+		if (insn->num & 0xFFFF0000) {
+			assert((insn->num & 0xFF000000) == 0);
+			insn->count = (insn->num >> 16) & 0xFF;
+		}
+		/* fall-through */
+	case 0x33: /* op_push_me1 */
+	case 0x34: /* op_push_member_array */
+	case 0x38: /* op_pop_me_array */
+		{
+			insn->member = (VMMemberCache *)allocCache(sob, sizeof(VMMemberCache));
+			const int num = insn->num & 0xFFFF;
+			if (num <= sob->refentries_count && sob->refentries_data[num].type == SOB_REFERENCE_TYPE_MEMBER) {
+				insn->member->ref = &sob->refentries_data[num];
+			}
+		}
+		break;
+	case 0x13: /* op_call_me */
+	case 0x14: /* op_call_method */
+	case 0x15: /* op_call_static */
+	case 0x1e: /* op_start_method */
+	case 0x20: /* op_start_static */
+	case 0x21: /* op_start_me */
+	case 0x8f: /* op_call_parent */
+	case 0x90: /* op_start_parent */
+		insn->method = (VMMethodCache *)allocCache(sob, sizeof(VMMethodCache));
+		break;
+	case 0x28: /* op_if_eq */
+	case 0x29: /* op_if_neq */
+	case 0xbc: /* op_iftop_eq */
+	case 0xbd: /* op_iftop_neq */
+		setTarget(sob, insn, offset, w);
+		break;
+	case 0x3c: /* op_push_string */
+		if (insn->num > 0 && insn->num <= sob->stringentries_count) {
+			insn->str = (const char *)sob->strings_data + sob->stringentries_data[insn->num];
+		}
+		break;
+	case 0x3e: /* op_syscall */
+	case 0x3f: /* op_fsyscall */
+		{
+			const int index = VM_FindSyscallIndex(c, insn->num);
+			if (index != -1) {
+				insn->op = (insn->op == 0x3e) ? 0xb6 : 0xb7; /* op_fast_syscall, op_fast_fsyscall */
+				insn->num = index;
+			}
+		}
+		break;
+	case 0xb0: /* op_gotodefine */
+		if (insn->num != 0) {
+			setTarget(sob, insn, offset, w);
+		}
+		break;
+	}
+	return true;
+}
+
+void Insn_DecodeAt(VMContext *c, SobData *sob, uint32_t offset) {
+	if (!sob->insns) {
+		sob->insns = (VMInsn *)calloc(sob->code_size + 1, sizeof(VMInsn));
+		if (!sob->insns) {
+			error("Failed to allocate %d instructions for class '%s'", sob->code_size, sob->class_name);
+		}
+	}
+	Worklist w = { 0, 0, 0 };
+	pushOffset(&w, offset);
+	while (w.count != 0) {
+		offset = w.data[--w.count];
+		while (offset < sob->code_size && sob->insns[offset].len == 0) {
+			if (!decodeInsn(c, sob, offset, &w)) {
+				break;
+			}
+			offset += sob->insns[offset].len;
+		}
+	}
+	free(w.data);
+}
+
+void Insn_DecodeSob(VMContext *c, SobData *sob) {
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		const SobCodeEntry *code = &sob->codeentries_data[i];
+		if (code->locals_offset != -1 && code->code_offset < sob->code_size) {
+			Insn_DecodeAt(c, sob, code->code_offset);
+		}
+	}
+	debug(DBG_VM, "Decoded class '%s' code size %d", sob->class_name, sob->code_size);
+}
+
+/* bytecode offsets executed after the instruction, the fused opcodes skip
+ * the instructions of the sequence */
+int Insn_GetSuccessors(SobData *sob, VMInsn *insn, int *offsets) {
+	const int next = insn + insn->len - sob->insns;
+	switch (insn->op) {
+	case 0x02: /* op_jump */
+		if (!insn->target) {
+			return 0;
+		}
+		offsets[0] = insn->target - sob->insns;
+		return 1;
+	case 0x04: /* op_return */
+	case 0x05:
+	case 0x41: /* op_quit */
+		return 0;
+	case 0xc2: /* op_add_local_int */
+		offsets[0] = insn->target + insn->target->len - sob->insns;
+		return 1;
+	case 0xc3: /* op_if_local_int */
+		offsets[0] = insn->target->target - sob->insns;
+		offsets[1] = insn->target + insn->target->len - sob->insns;
+		return 2;
+	}
+	offsets[0] = next;
+	if (insn->target && (insn->op == 0x28 || insn->op == 0x29 || insn->op == 0xb0 || insn->op == 0xbc || insn->op == 0xbd)) {
+		offsets[1] = insn->target - sob->insns;
+		return 2;
+	}
+	return 1;
+}
+
+static const VMInsn *nextInsn(const VMInsn *insn) {
+	const VMInsn *next = insn + insn->len;
+	return (next->len != 0) ? next : 0;
+}
+
+static bool isPushInt(const VMInsn *insn) {
+	return insn && (insn->op == 0x06 || insn->op == 0x07);
+}
+
+/* superinstructions matched on the opcodes checked by VM_VerifySob. Only the
+ * first opcode of the sequence is replaced, the jumps to the following ones
+ * still execute the original opcodes. */
+void Insn_FuseSob(VMContext *c, SobData *sob) {
+	int count = 0, insns_count = 0;
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		VMInsn *insn = &sob->insns[offset];
+		if (insn->len != 0) {
+			++insns_count;
+		}
+		if (insn->op != 0xc0) { /* op_push_local_unchecked */
+			continue;
+		}
+		const VMInsn *insn2 = nextInsn(insn);
+		if (!isPushInt(insn2)) {
+			continue;
+		}
+		const VMInsn *insn3 = nextInsn(insn2);
+		const VMInsn *insn4 = insn3 ? nextInsn(insn3) : 0;
+		if (!insn4) {
+			continue;
+		}
+		if ((insn3->op == 0x18 || insn3->op == 0x19) && insn4->op == 0xc1) {
+			/* local = local +/- constant */
+			insn->op = 0xc2; /* op_add_local_int */
+		} else if (insn3->op >= 0x2c && insn3->op <= 0x31 && (insn4->op == 0x28 || insn4->op == 0x29) && insn4->target) {
+			/* if (local <cmp> constant) */
+			insn->op = 0xc3; /* op_if_local_int */
+		} else {
+			continue;
+		}
+		insn->type = insn3->op;
+		insn->target = (VMInsn *)insn4;
+		++count;
+	}
+	/* static count, the executed sequences are not weighted */
+	debug(DBG_VM, "Fused %d sequences in class '%s' (%d of %d instructions)", count, sob->class_name, count * 4, insns_count);
+}
@@ -0,0 +1,719 @@
+#include "util.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/* template compiler for the methods called more than 'threshold' times.
+ * The native code works on the context stack and the script locals, the
+ * opcodes handled by VM_Execute out of line are called back with
+ * VM_ExecuteInsn. The code is compiled for every instruction reached from
+ * the method entry and can be entered at any of them, eg. after a breakhere.
+ *
+ * registers: rbx context, r12 stack, r13d sp, r14 script, r15 locals */
+
+#define JIT_CHECK_STEPS (1 << 26)
+
+enum {
+	LABEL_EXIT      = -1,
+	LABEL_UNDERFLOW = -2,
+	LABEL_OVERFLOW  = -3,
+};
+
+/* x86 condition codes */
+enum {
+	CC_E  = 0x4,
+	CC_NE = 0x5,
+	CC_S  = 0x8,
+	CC_L  = 0xc,
+	CC_GE = 0xd,
+	CC_LE = 0xe,
+	CC_G  = 0xf,
+};
+
+typedef struct {
+	int pos; /* rel32 position in the buffer */
+	int label; /* bytecode offset or LABEL_ */
+} JitFixup;
+
+typedef struct {
+	uint8_t *data;
+	int size, capacity;
+	JitFixup *fixups;
+	int fixups_count, fixups_capacity;
+	int *labels; /* native position by bytecode offset, -1 if not emitted */
+	int exit, underflow, overflow;
+} JitBuffer;
+
+typedef struct {
+	uint8_t *p;
+	int size;
+} JitBlock;
+
+/* state at the start of the native sequence being executed, replayed with
+ * the interpreter when the sequence ends */
+typedef struct jitcheck_t {
+	struct jitcheck_t *prev;
+	VMInsn *code; /* 0 if no sequence started */
+	int sp;
+	VMVar stack[VMSTACK_SIZE];
+	VMVar *locals;
+	int locals_count;
+	VMVar result_stack[VMSTACK_SIZE];
+	VMVar *result_locals;
+} JitCheck;
+
+typedef void (*JitEnterProc)(VMContext *c, VMScript *script, const void *entry);
+
+struct vmjit_t {
+	int threshold;
+	int check;
+	JitEnterProc enter;
+	const uint8_t *epilogue;
+	JitBlock *blocks;
+	int blocks_count, blocks_capacity;
+	int methods_count;
+	int checked_count;
+	JitCheck *checks;
+};
+
+static void emitBytes(JitBuffer *b, const void *p, int size) {
+	if (b->size + size > b->capacity) {
+		b->capacity = (b->capacity == 0) ? 4096 : b->capacity * 2;
+		b->data = (uint8_t *)realloc(b->data, b->capacity);
+		if (!b->data) {
+			error("Failed to allocate %d bytes JIT buffer", b->capacity);
+		}
+	}
+	memcpy(b->data + b->size, p, size);
+	b->size += size;
+}
+
+static void emit8(JitBuffer *b, uint8_t value) {
+	emitBytes(b, &value, 1);
+}
+
+static void emit32(JitBuffer *b, uint32_t value) {
+	emitBytes(b, &value, 4);
+}
+
+static void emit64(JitBuffer *b, uint64_t value) {
+	emitBytes(b, &value, 8);
+}
+
+#define EMIT(b, ...) do { static const uint8_t code[] = { __VA_ARGS__ }; emitBytes(b, code, sizeof(code)); } while (0)
+
+static void emitRel32(JitBuffer *b, int label) {
+	if (b->fixups_count == b->fixups_capacity) {
+		b->fixups_capacity = (b->fixups_capacity == 0) ? 256 : b->fixups_capacity * 2;
+		b->fixups = (JitFixup *)realloc(b->fixups, b->fixups_capacity * sizeof(JitFixup));
+		if (!b->fixups) {
+			error("Failed to allocate %d JIT fixups", b->fixups_capacity);
+		}
+	}
+	b->fixups[b->fixups_count].pos = b->size;
+	b->fixups[b->fixups_count].label = label;
+	++b->fixups_count;
+	emit32(b, 0);
+}
+
+static void emitJump(JitBuffer *b, int label) {
+	emit8(b, 0xE9);
+	emitRel32(b, label);
+}
+
+static void emitJcc(JitBuffer *b, int cc, int label) {
+	emit8(b, 0x0F);
+	emit8(b, 0x80 | cc);
+	emitRel32(b, label);
+}
+
+/* jump to the next native code, patched with patchForward */
+static int emitJccForward(JitBuffer *b, int cc) {
+	emit8(b, 0x0F);
+	emit8(b, 0x80 | cc);
+	emit32(b, 0);
+	return b->size - 4;
+}
+
+static void patchForward(JitBuffer *b, int pos) {
+	const int32_t rel = b->size - (pos + 4);
+	memcpy(b->data + pos, &rel, 4);
+}
+
+/* [r12 + r13 * 8 + disp], the stack entry at sp */
+static void emitStackOperand(JitBuffer *b, int reg, int disp) {
+	emit8(b, 0x84 | (reg << 3));
+	emit8(b, 0xEC);
+	emit32(b, disp);
+}
+
+/* [r15 + disp], the local variable */
+static void emitLocalOperand(JitBuffer *b, int reg, int num, int disp) {
+	emit8(b, 0x87 | (reg << 3));
+	emit32(b, num * sizeof(VMVar) + disp);
+}
+
+static void emitPushCheck(JitBuffer *b) {
+	EMIT(b, 0x41, 0x83, 0xC5, 0x01); /* add r13d, 1 */
+	EMIT(b, 0x41, 0x81, 0xFD); /* cmp r13d, VMSTACK_SIZE */
+	emit32(b, VMSTACK_SIZE);
+	emitJcc(b, CC_GE, LABEL_OVERFLOW);
+}
+
+static void emitPopCheck(JitBuffer *b, int count) {
+	EMIT(b, 0x41, 0x83, 0xED); /* sub r13d, count */
+	emit8(b, count);
+	emitJcc(b, CC_S, LABEL_UNDERFLOW);
+}
+
+static void emitStoreSpAndCall(JitBuffer *b, const void *proc) {
+	EMIT(b, 0x44, 0x89, 0xAB); /* mov [rbx + sp], r13d */
+	emit32(b, offsetof(VMContext, sp));
+	EMIT(b, 0x48, 0xB8); /* mov rax, proc */
+	emit64(b, (uintptr_t)proc);
+	EMIT(b, 0xFF, 0xD0); /* call rax */
+}
+
+static int compareCondition(int op) {
+	switch (op) {
+	case 0x2c:
+		return CC_E;
+	case 0x2d:
+		return CC_NE;
+	case 0x2e:
+		return CC_LE;
+	case 0x2f:
+		return CC_GE;
+	case 0x30:
+		return CC_L;
+	default:
+		return CC_G;
+	}
+}
+
+static void stackError(int overflow) {
+	error(overflow ? "Stack overflow" : "Stack underflow");
+}
+
+static void beginCheck(VMContext *c) {
+	JitCheck *ck = c->jit->checks;
+	const VMScript *script = c->script;
+	ck->code = c->code;
+	ck->sp = c->sp;
+	memcpy(ck->stack, c->stack, c->sp * sizeof(VMVar));
+	memcpy(ck->locals, script->local_vars, script->local_vars_count * sizeof(VMVar));
+}
+
+/* replays the sequence with the interpreter from the saved state and
+ * compares the stack and locals with the native code ones */
+static void endCheck(VMContext *c, VMInsn *stop) {
+	JitCheck *ck = c->jit->checks;
+	if (!ck->code) {
+		return;
+	}
+	VMScript *script = c->script;
+	const int sp = c->sp;
+	memcpy(ck->result_stack, c->stack, sp * sizeof(VMVar));
+	memcpy(ck->result_locals, script->local_vars, ck->locals_count * sizeof(VMVar));
+	c->code = ck->code;
+	c->sp = ck->sp;
+	memcpy(c->stack, ck->stack, ck->sp * sizeof(VMVar));
+	memcpy(script->local_vars, ck->locals, ck->locals_count * sizeof(VMVar));
+	const SobData *sob = script->sob_data;
+	for (int count = 0; c->code != stop; ++count) {
+		if (count == JIT_CHECK_STEPS) {
+			error("JIT mismatch in class '%s' at offset %d, offset %d not reached", sob->class_name, (int)(ck->code - sob->insns), (int)(stop - sob->insns));
+		}
+		VMInsn *insn = c->code;
+		c->code += insn->len;
+		VM_ExecuteInsn(c, insn);
+	}
+	if (c->sp != sp || memcmp(c->stack, ck->result_stack, sp * sizeof(VMVar)) != 0 || memcmp(script->local_vars, ck->result_locals, ck->locals_count * sizeof(VMVar)) != 0) {
+		error("JIT mismatch in class '%s' from offset %d to %d", sob->class_name, (int)(ck->code - sob->insns), (int)(stop - sob->insns));
+	}
+	++c->jit->checked_count;
+	ck->code = 0;
+}
+
+/* returns 1 if the native code must exit, for a yield, a return or a jump
+ * done out of line */
+static int callOpcode(VMContext *c, VMInsn *insn) {
+	VMScript *script = c->script;
+	VMInsn *next = insn + insn->len;
+	if (c->jit->check) {
+		endCheck(c, insn);
+	}
+	c->code = next;
+	VM_ExecuteInsn(c, insn);
+	if (script->state != 0) {
+		return 1;
+	}
+	if (script->thread->state != SCRIPT_STATE_RUNNING) {
+		script->state = script->thread->state;
+		return 1;
+	}
+	if (c->code != next) {
+		return 1;
+	}
+	if (c->jit->check) {
+		beginCheck(c);
+	}
+	return 0;
+}
+
+static void emitCall(JitBuffer *b, VMInsn *insn) {
+	EMIT(b, 0x48, 0x89, 0xDF); /* mov rdi, rbx */
+	EMIT(b, 0x48, 0xBE); /* mov rsi, insn */
+	emit64(b, (uintptr_t)insn);
+	emitStoreSpAndCall(b, (const void *)callOpcode);
+	EMIT(b, 0x44, 0x8B, 0xAB); /* mov r13d, [rbx + sp] */
+	emit32(b, offsetof(VMContext, sp));
+	EMIT(b, 0x4D, 0x8B, 0xBE); /* mov r15, [r14 + local_vars] */
+	emit32(b, offsetof(VMScript, local_vars));
+	EMIT(b, 0x85, 0xC0); /* test eax, eax */
+	emitJcc(b, CC_NE, LABEL_EXIT);
+}
+
+/* member from the first inline cache entry, same as VM_Execute */
+static void emitPushMe(JitBuffer *b, VMInsn *insn) {
+	EMIT(b, 0x49, 0x8B, 0x86); /* mov rax, [r14 + obj] */
+	emit32(b, offsetof(VMScript, obj));
+	EMIT(b, 0x48, 0x85, 0xC0); /* test rax, rax */
+	const int no_obj = emitJccForward(b, CC_E);
+	EMIT(b, 0x48, 0xBA); /* mov rdx, cache */
+	emit64(b, (uintptr_t)insn->member);
+	EMIT(b, 0x81, 0xBA); /* cmp dword [rdx + count], 0 */
+	emit32(b, offsetof(VMMemberCache, count));
+	emit32(b, 0);
+	const int no_cache = emitJccForward(b, CC_E);
+	EMIT(b, 0x8B, 0x88); /* mov ecx, [rax + class_handle] */
+	emit32(b, offsetof(VMObject, class_handle));
+	EMIT(b, 0x3B, 0x8A); /* cmp ecx, [rdx + class_handle[0]] */
+	emit32(b, offsetof(VMMemberCache, class_handle));
+	const int miss = emitJccForward(b, CC_NE);
+	EMIT(b, 0x48, 0x63, 0x8A); /* movsxd rcx, [rdx + data_index[0]] */
+	emit32(b, offsetof(VMMemberCache, data_index));
+	EMIT(b, 0x48, 0x8B, 0x80); /* mov rax, [rax + members] */
+	emit32(b, offsetof(VMObject, members));
+	EMIT(b, 0x48, 0x8B, 0x04, 0xC8); /* mov rax, [rax + rcx * 8] */
+	EMIT(b, 0x4B, 0x89); /* mov [stack + sp], rax */
+	emitStackOperand(b, 0, 0);
+	emitPushCheck(b);
+	emit8(b, 0xE9); /* jmp done */
+	emit32(b, 0);
+	const int done = b->size - 4;
+	patchForward(b, no_obj);
+	patchForward(b, no_cache);
+	patchForward(b, miss);
+	emitCall(b, insn);
+	patchForward(b, done);
+}
+
+/* emits the opcode, returns false if there is no fall-through */
+static bool emitInsn(JitBuffer *b, SobData *sob, VMInsn *insn) {
+	switch (insn->op) {
+	case 0x02: /* op_jump */
+		if (!insn->target) {
+			break;
+		}
+		emitJump(b, insn->target - sob->insns);
+		return false;
+	case 0x06: /* op_push_int8 */
+	case 0x07: /* op_push_int32 */
+		EMIT(b, 0x43, 0xC7); /* mov dword [stack + sp].type, VAR_TYPE_INT32 */
+		emitStackOperand(b, 0, 0);
+		emit32(b, VAR_TYPE_INT32);
+		EMIT(b, 0x43, 0xC7); /* mov dword [stack + sp].value, num */
+		emitStackOperand(b, 0, 4);
+		emit32(b, insn->num);
+		emitPushCheck(b);
+		return true;
+	case 0x09: /* op_push_me */
+		if (insn->count != 1) {
+			break;
+		}
+		emitPushMe(b, insn);
+		return true;
+	case 0x0d: /* op_pop */
+		emitPopCheck(b, 1);
+		return true;
+	case 0x18: /* op_add_int */
+	case 0x19: /* op_sub_int */
+	case 0x1a: /* op_mul_int */
+	case 0x2a: /* op_and */
+	case 0x2b: /* op_or */
+	case 0x2c: /* op_eq_int */
+	case 0x2d: /* op_neq_int */
+	case 0x2e: /* op_leq_int */
+	case 0x2f: /* op_geq_int */
+	case 0x30: /* op_lt_int */
+	case 0x31: /* op_gt_int */
+		emitPopCheck(b, 2);
+		EMIT(b, 0x43, 0x8B); /* mov eax, a */
+		emitStackOperand(b, 0, 4);
+		EMIT(b, 0x43, 0x8B); /* mov ecx, b */
+		emitStackOperand(b, 1, sizeof(VMVar) + 4);
+		switch (insn->op) {
+		case 0x18:
+			EMIT(b, 0x01, 0xC8); /* add eax, ecx */
+			break;
+		case 0x19:
+			EMIT(b, 0x29, 0xC8); /* sub eax, ecx */
+			break;
+		case 0x1a:
+			EMIT(b, 0x0F, 0xAF, 0xC1); /* imul eax, ecx */
+			break;
+		case 0x2a:
+			EMIT(b, 0x85, 0xC0, 0x0F, 0x95, 0xC0); /* test eax, eax; setne al */
+			EMIT(b, 0x85, 0xC9, 0x0F, 0x95, 0xC1); /* test ecx, ecx; setne cl */
+			EMIT(b, 0x20, 0xC8, 0x0F, 0xB6, 0xC0); /* and al, cl; movzx eax, al */
+			break;
+		case 0x2b:
+			EMIT(b, 0x09, 0xC8, 0x0F, 0x95, 0xC0); /* or eax, ecx; setne al */
+			EMIT(b, 0x0F, 0xB6, 0xC0); /* movzx eax, al */
+			break;
+		default:
+			EMIT(b, 0x39, 0xC8, 0x0F); /* cmp eax, ecx; setcc al */
+			emit8(b, 0x90 | compareCondition(insn->op));
+			EMIT(b, 0xC0, 0x0F, 0xB6, 0xC0); /* movzx eax, al */
+			break;
+		}
+		EMIT(b, 0x43, 0xC7); /* mov dword [stack + sp].type, VAR_TYPE_INT32 */
+		emitStackOperand(b, 0, 0);
+		emit32(b, VAR_TYPE_INT32);
+		EMIT(b, 0x43, 0x89); /* mov [stack + sp].value, eax */
+		emitStackOperand(b, 0, 4);
+		EMIT(b, 0x41, 0x83, 0xC5, 0x01); /* add r13d, 1 */
+		return true;
+	case 0x28: /* op_if_eq */
+	case 0x29: /* op_if_neq */
+		if (!insn->target) {
+			break;
+		}
+		emitPopCheck(b, 1);
+		EMIT(b, 0x43, 0x81); /* cmp dword [stack + sp].value, 0 */
+		emitStackOperand(b, 7, 4);
+		emit32(b, 0);
+		emitJcc(b, (insn->op == 0x28) ? CC_NE : CC_E, insn->target - sob->insns);
+		return true;
+	case 0x48: /* op_not_int */
+		emitPopCheck(b, 1);
+		EMIT(b, 0x43, 0x81); /* cmp dword [stack + sp].value, 0 */
+		emitStackOperand(b, 7, 4);
+		emit32(b, 0);
+		EMIT(b, 0x0F, 0x94, 0xC0, 0x0F, 0xB6, 0xC0); /* sete al; movzx eax, al */
+		EMIT(b, 0x43, 0xC7); /* mov dword [stack + sp].type, VAR_TYPE_INT32 */
+		emitStackOperand(b, 0, 0);
+		emit32(b, VAR_TYPE_INT32);
+		EMIT(b, 0x43, 0x89); /* mov [stack + sp].value, eax */
+		emitStackOperand(b, 0, 4);
+		EMIT(b, 0x41, 0x83, 0xC5, 0x01); /* add r13d, 1 */
+		return true;
+	case 0x6c: /* op_dup */
+		EMIT(b, 0x45, 0x85, 0xED); /* test r13d, r13d */
+		emitJcc(b, CC_LE, LABEL_UNDERFLOW);
+		EMIT(b, 0x4B, 0x8B); /* mov rax, [stack + sp - 1] */
+		emitStackOperand(b, 0, -(int)sizeof(VMVar));
+		EMIT(b, 0x4B, 0x89); /* mov [stack + sp], rax */
+		emitStackOperand(b, 0, 0);
+		emitPushCheck(b);
+		return true;
+	case 0xbc: /* op_iftop_eq */
+	case 0xbd: /* op_iftop_neq */
+		if (!insn->target) {
+			break;
+		}
+		EMIT(b, 0x45, 0x85, 0xED); /* test r13d, r13d */
+		emitJcc(b, CC_LE, LABEL_UNDERFLOW);
+		EMIT(b, 0x43, 0x81); /* cmp dword [stack + sp - 1].value, 0 */
+		emitStackOperand(b, 7, -(int)sizeof(VMVar) + 4);
+		emit32(b, 0);
+		emitJcc(b, (insn->op == 0xbc) ? CC_NE : CC_E, insn->target - sob->insns);
+		return true;
+	case 0xc0: /* op_push_local_unchecked */
+		EMIT(b, 0x49, 0x8B); /* mov rax, [locals + num] */
+		emitLocalOperand(b, 0, insn->num, 0);
+		EMIT(b, 0x4B, 0x89); /* mov [stack + sp], rax */
+		emitStackOperand(b, 0, 0);
+		emitPushCheck(b);
+		return true;
+	case 0xc1: /* op_pop_local_unchecked */
+		EMIT(b, 0x41, 0x83, 0xED, 0x01); /* sub r13d, 1 */
+		EMIT(b, 0x43, 0x8B); /* mov eax, [stack + sp].value */
+		emitStackOperand(b, 0, 4);
+		EMIT(b, 0x41, 0x89); /* mov [locals + num].value, eax */
+		emitLocalOperand(b, 0, insn->num, 4);
+		return true;
+	case 0xc2: { /* op_add_local_int */
+			const VMInsn *last = insn->target;
+			EMIT(b, 0x41, 0x8B); /* mov eax, [locals + num].value */
+			emitLocalOperand(b, 0, insn->num, 4);
+			emit8(b, (insn->type == 0x18) ? 0x05 : 0x2D); /* add/sub eax, value */
+			emit32(b, (insn + insn->len)->num);
+			EMIT(b, 0x41, 0x89); /* mov [locals + last.num].value, eax */
+			emitLocalOperand(b, 0, last->num, 4);
+			emitJump(b, last + last->len - sob->insns);
+		}
+		return false;
+	case 0xc3: { /* op_if_local_int */
+			const VMInsn *last = insn->target;
+			const int cc = compareCondition(insn->type);
+			EMIT(b, 0x41, 0x81); /* cmp dword [locals + num].value, value */
+			emitLocalOperand(b, 7, insn->num, 4);
+			emit32(b, (insn + insn->len)->num);
+			emitJcc(b, (last->op == 0x28) ? cc : (cc ^ 1), last->target - sob->insns);
+			emitJump(b, last + last->len - sob->insns);
+		}
+		return false;
+	}
+	emitCall(b, insn);
+	return true;
+}
+
+static void addBlock(VMJit *jit, uint8_t *p, int size) {
+	if (jit->blocks_count == jit->blocks_capacity) {
+		jit->blocks_capacity = (jit->blocks_capacity == 0) ? 64 : jit->blocks_capacity * 2;
+		jit->blocks = (JitBlock *)realloc(jit->blocks, jit->blocks_capacity * sizeof(JitBlock));
+		if (!jit->blocks) {
+			error("Failed to allocate %d JIT blocks", jit->blocks_capacity);
+		}
+	}
+	jit->blocks[jit->blocks_count].p = p;
+	jit->blocks[jit->blocks_count].size = size;
+	++jit->blocks_count;
+}
+
+static uint8_t *copyCode(VMJit *jit, const uint8_t *data, int size) {
+	uint8_t *p = (uint8_t *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		error("Failed to map %d bytes of JIT code", size);
+	}
+	memcpy(p, data, size);
+	if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+		error("Failed to protect %d bytes of JIT code", size);
+	}
+	addBlock(jit, p, size);
+	return p;
+}
+
+/* the entry code saves the registers and jumps to the native instruction */
+static void compileEnter(VMJit *jit) {
+	JitBuffer b;
+	memset(&b, 0, sizeof(b));
+	EMIT(&b, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); /* push rbx, rbp, r12, r13, r14, r15 */
+	EMIT(&b, 0x48, 0x83, 0xEC, 0x08); /* sub rsp, 8 */
+	EMIT(&b, 0x48, 0x89, 0xFB); /* mov rbx, rdi */
+	EMIT(&b, 0x49, 0x89, 0xF6); /* mov r14, rsi */
+	EMIT(&b, 0x4C, 0x8D, 0xA3); /* lea r12, [rbx + stack] */
+	emit32(&b, offsetof(VMContext, stack));
+	EMIT(&b, 0x44, 0x8B, 0xAB); /* mov r13d, [rbx + sp] */
+	emit32(&b, offsetof(VMContext, sp));
+	EMIT(&b, 0x4D, 0x8B, 0xBE); /* mov r15, [r14 + local_vars] */
+	emit32(&b, offsetof(VMScript, local_vars));
+	EMIT(&b, 0xFF, 0xE2); /* jmp rdx */
+	const int epilogue = b.size;
+	EMIT(&b, 0x48, 0x83, 0xC4, 0x08); /* add rsp, 8 */
+	EMIT(&b, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3); /* pop r15, r14, r13, r12, rbp, rbx; ret */
+	uint8_t *p = copyCode(jit, b.data, b.size);
+	jit->enter = (JitEnterProc)p;
+	jit->epilogue = p + epilogue;
+	free(b.data);
+}
+
+static int getLabel(JitBuffer *b, SobData *sob, int label) {
+	switch (label) {
+	case LABEL_EXIT:
+		return b->exit;
+	case LABEL_UNDERFLOW:
+		return b->underflow;
+	case LABEL_OVERFLOW:
+		return b->overflow;
+	}
+	if (b->labels[label] == -1) { /* not compiled, continue with the interpreter */
+		b->labels[label] = b->size;
+		EMIT(b, 0x44, 0x89, 0xAB); /* mov [rbx + sp], r13d */
+		emit32(b, offsetof(VMContext, sp));
+		EMIT(b, 0x48, 0xB8); /* mov rax, insn */
+		emit64(b, (uintptr_t)(sob->insns + label));
+		EMIT(b, 0x48, 0x89, 0x83); /* mov [rbx + code], rax */
+		emit32(b, offsetof(VMContext, code));
+		emitJump(b, LABEL_EXIT);
+	}
+	return b->labels[label];
+}
+
+static void compileMethod(VMJit *jit, SobData *sob, SobCodeEntry *code) {
+	if (!sob->jit_entries) {
+		sob->jit_entries = (void **)calloc(sob->code_size + 1, sizeof(void *));
+		if (!sob->jit_entries) {
+			error("Failed to allocate JIT entries for class '%s'", sob->class_name);
+		}
+	}
+	JitBuffer b;
+	memset(&b, 0, sizeof(b));
+	b.labels = (int *)malloc((sob->code_size + 1) * sizeof(int));
+	uint8_t *reached = (uint8_t *)calloc(sob->code_size + 1, 1);
+	uint32_t *offsets = (uint32_t *)malloc((sob->code_size + 1) * sizeof(uint32_t));
+	if (!b.labels || !reached || !offsets) {
+		error("Failed to allocate JIT compiler for class '%s'", sob->class_name);
+	}
+	for (int i = 0; i <= sob->code_size; ++i) {
+		b.labels[i] = -1;
+	}
+	int count = 0;
+	offsets[count++] = code->code_offset;
+	reached[code->code_offset] = 1;
+	while (count != 0) {
+		VMInsn *insn = &sob->insns[offsets[--count]];
+		int next[2];
+		const int next_count = Insn_GetSuccessors(sob, insn, next);
+		for (int i = 0; i < next_count; ++i) {
+			const int offset = next[i];
+			if (offset < sob->code_size && sob->insns[offset].len != 0 && !reached[offset]) {
+				reached[offset] = 1;
+				offsets[count++] = offset;
+			}
+		}
+	}
+	int fallthrough = -1;
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		if (!reached[offset]) {
+			continue;
+		}
+		if (fallthrough != -1 && fallthrough != offset) {
+			emitJump(&b, fallthrough);
+		}
+		VMInsn *insn = &sob->insns[offset];
+		b.labels[offset] = b.size;
+		fallthrough = emitInsn(&b, sob, insn) ? (offset + insn->len) : -1;
+	}
+	if (fallthrough != -1) {
+		emitJump(&b, fallthrough);
+	}
+	b.exit = b.size;
+	EMIT(&b, 0x48, 0xB8); /* mov rax, epilogue */
+	emit64(&b, (uintptr_t)jit->epilogue);
+	EMIT(&b, 0xFF, 0xE0); /* jmp rax */
+	b.underflow = b.size;
+	EMIT(&b, 0xBF); /* mov edi, 0 */
+	emit32(&b, 0);
+	emitStoreSpAndCall(&b, (const void *)stackError);
+	b.overflow = b.size;
+	EMIT(&b, 0xBF); /* mov edi, 1 */
+	emit32(&b, 1);
+	emitStoreSpAndCall(&b, (const void *)stackError);
+	/* the exit stubs may add fixups */
+	for (int i = 0; i < b.fixups_count; ++i) {
+		const int target = getLabel(&b, sob, b.fixups[i].label);
+		const int32_t rel = target - (b.fixups[i].pos + 4);
+		memcpy(b.data + b.fixups[i].pos, &rel, 4);
+	}
+	uint8_t *p = copyCode(jit, b.data, b.size);
+	int compiled = 0;
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		if (reached[offset]) {
+			sob->jit_entries[offset] = p + b.labels[offset];
+			++compiled;
+		}
+	}
+	++jit->methods_count;
+	debug(DBG_VM, "JIT compiled method at offset %d in class '%s', %d opcodes %d bytes", code->code_offset, sob->class_name, compiled, b.size);
+	free(offsets);
+	free(reached);
+	free(b.labels);
+	free(b.fixups);
+	free(b.data);
+}
+
+VMJit *VM_NewJit(int threshold, int check) {
+	VMJit *jit = (VMJit *)calloc(1, sizeof(VMJit));
+	if (!jit) {
+		error("Failed to allocate JIT");
+	}
+	jit->threshold = threshold;
+	jit->check = check;
+	compileEnter(jit);
+	return jit;
+}
+
+void VM_FreeJit(VMJit *jit) {
+	if (jit) {
+		debug(DBG_INFO, "JIT compiled %d methods, %d sequences checked", jit->methods_count, jit->checked_count);
+		for (int i = 0; i < jit->blocks_count; ++i) {
+			munmap(jit->blocks[i].p, jit->blocks[i].size);
+		}
+		free(jit->blocks);
+		free(jit);
+	}
+}
+
+void VM_JitCountCall(VMContext *c, SobCodeEntry *code) {
+	if (++code->calls_count == c->jit->threshold) {
+		SobData *sob = ClassHandle_GetSob(c, code->class_handle);
+		if (sob->insns && code->code_offset < sob->code_size && sob->insns[code->code_offset].len != 0 && !(sob->jit_entries && sob->jit_entries[code->code_offset])) { /* not already compiled from an inherited entry */
+			compileMethod(c->jit, sob, code);
+		}
+	}
+}
+
+int VM_JitExecute(VMContext *c, VMScript *script) {
+	VMJit *jit = c->jit;
+	SobData *sob = script->sob_data;
+	if (!sob->jit_entries) {
+		return 0;
+	}
+	JitCheck *ck = 0;
+	if (jit->check) {
+		ck = (JitCheck *)malloc(sizeof(JitCheck));
+		VMVar *locals = (VMVar *)malloc(script->local_vars_count * 2 * sizeof(VMVar) + 1);
+		if (!ck || !locals) {
+			error("Failed to allocate JIT check state");
+		}
+		ck->prev = jit->checks;
+		ck->locals = locals;
+		ck->result_locals = locals + script->local_vars_count;
+		ck->locals_count = script->local_vars_count;
+		jit->checks = ck;
+	}
+	while (script->state == 0) {
+		const void *entry = sob->jit_entries[c->code - sob->insns];
+		if (!entry) {
+			break;
+		}
+		if (ck) {
+			beginCheck(c);
+		}
+		jit->enter(c, script, entry);
+		if (ck) { /* exit stub to the interpreter */
+			endCheck(c, c->code);
+		}
+	}
+	if (ck) {
+		jit->checks = ck->prev;
+		free(ck->locals);
+		free(ck);
+	}
+	return script->state != 0;
+}
+
+#else
+
+VMJit *VM_NewJit(int threshold, int check) {
+	warning("JIT is not supported on this platform");
+	return 0;
+}
+
+void VM_FreeJit(VMJit *jit) {
+}
+
+void VM_JitCountCall(VMContext *c, SobCodeEntry *code) {
+}
+
+int VM_JitExecute(VMContext *c, VMScript *script) {
+	return 0;
+}
+
+#endif
@@ -2,23 +2,78 @@
 #include "util.h"
 #include "vm.h"
 
+#define OBJECT_GENERATIONS VMHANDLE_GENERATIONS(BASE_HANDLE_OBJECT, BASE_HANDLE_ARRAY)
+
 VMObject *VM_GetObjectFromHandle(VMContext *c, int num) {
 	const int x = num - BASE_HANDLE_OBJECT;
-	if (x < 0 || x >= VMOBJECTS_COUNT) {
-		error("Object handle %d out of range (%d..%d)", num, BASE_HANDLE_OBJECT, BASE_HANDLE_OBJECT + VMOBJECTS_COUNT);
+	if (x < 0 || (x >> VMHANDLE_INDEX_BITS) >= OBJECT_GENERATIONS || (x & VMHANDLE_INDEX_MASK) >= c->objects_capacity) {
+		error("Object handle %d out of range (%d..%d)", num, BASE_HANDLE_OBJECT, BASE_HANDLE_OBJECT + c->objects_capacity);
+	}
+	VMObject *obj = VM_GetObjectSlot(c, x & VMHANDLE_INDEX_MASK);
+	if (obj->handle != num) {
+		error("Object handle %d was deleted", num);
 	}
-	VMObject *obj = &c->objects[x];
-	assert(obj->handle == num);
 	return obj;
 }
 
+/* returns 0 if the value is not a live object handle */
+VMObject *ObjectHandle_Find(VMContext *c, uint32_t handle) {
+	const uint32_t x = handle - BASE_HANDLE_OBJECT;
+	if (x < (OBJECT_GENERATIONS << VMHANDLE_INDEX_BITS) && (x & VMHANDLE_INDEX_MASK) < c->objects_capacity) {
+		VMObject *obj = VM_GetObjectSlot(c, x & VMHANDLE_INDEX_MASK);
+		if (obj->handle == handle) {
+			return obj;
+		}
+	}
+	return 0;
+}
+
+static void freeObjectSlot(VMContext *c, int num) {
+	VM_GetObjectSlot(c, num)->next_free = 0;
+	if (c->objects_free_tail != 0) {
+		VM_GetObjectSlot(c, c->objects_free_tail)->next_free = num;
+	} else {
+		c->objects_next_free = num;
+	}
+	c->objects_free_tail = num;
+}
+
+static void growObjects(VMContext *c) {
+	const int num = c->objects_capacity;
+	VMObject *chunk = (VMObject *)calloc(VMPOOL_CHUNK_SIZE, sizeof(VMObject));
+	if (!chunk) {
+		error("Failed to allocate %d objects", VMPOOL_CHUNK_SIZE);
+	}
+	c->objects[num / VMPOOL_CHUNK_SIZE] = chunk;
+	c->objects_capacity = num + VMPOOL_CHUNK_SIZE;
+	for (int i = (num == 0) ? 1 : 0; i < VMPOOL_CHUNK_SIZE; ++i) { /* slot 0 is the null handle */
+		freeObjectSlot(c, num + i);
+	}
+	debug(DBG_VM, "Objects pool capacity %d", c->objects_capacity);
+}
+
 VMObject *Object_New(VMContext *c) {
-	assert(c->objects_next_free != 0);
+	while (c->objects_capacity - 1 - c->objects_count < VMPOOL_MIN_FREE && c->objects_capacity < (1 << VMHANDLE_INDEX_BITS)) {
+		growObjects(c);
+	}
+	if (c->objects_next_free == 0) {
+		error("Too many objects allocated (%d)", c->objects_count);
+	}
 	const int num = c->objects_next_free;
-	VMObject *obj = &c->objects[num];
+	VMObject *obj = VM_GetObjectSlot(c, num);
 	c->objects_next_free = obj->next_free;
+	if (c->objects_next_free == 0) {
+		c->objects_free_tail = 0;
+	}
+	const int generation = obj->generation;
 	memset(obj, 0, sizeof(VMObject));
-	obj->handle = BASE_HANDLE_OBJECT + num;
+	obj->generation = generation;
+	obj->handle = BASE_HANDLE_OBJECT + ((generation << VMHANDLE_INDEX_BITS) | num);
+	obj->gc_dirty = 1;
+	if (c->gc) {
+		VM_GCMarkNew(c, obj->handle);
+	}
+	++c->objects_count;
 	return obj;
 }
 
@@ -35,18 +90,19 @@ int ObjectHandle_Create(VMContext *c, int class_handle) {
 	SobData *sob = ClassHandle_GetSob(c, class_handle);
 	const int count = sob->default_membervars_count;
 	if (count != 0) {
-		obj->members = (VMVar *)calloc(count + 1, sizeof(VMVar));
-		if (!obj->members) {
-			error("Failed to allocate %d member vars", count + 1);
+		VMVar *members = (VMVar *)sob->members_free;
+		if (members) {
+			sob->members_free = *(void **)members;
 		} else {
-			for (int i = 1; i <= sob->default_membervars_count; ++i) {
-				const SobVar *var = &sob->default_membervars_data[i];
-				VM_CheckVarType(var->type);
-				obj->members[i].type = var->type;
-				obj->members[i].value = var->value;
+			members = (VMVar *)VM_HeapAlloc(c->heap, (count + 1) * sizeof(VMVar), 0);
+			if (!members) {
+				error("Failed to allocate %d member vars", count + 1);
 			}
-			obj->members_count = count;
 		}
+		/* SobVar and VMVar have the same layout */
+		memcpy(members, sob->default_membervars_data, (count + 1) * sizeof(VMVar));
+		obj->members = members;
+		obj->members_count = count;
 	}
 	return obj->handle;
 }
@@ -55,9 +111,16 @@ void ObjectHandle_Delete(VMContext *c, int obj_handle, int call_delete) {
 	if (obj_handle != 0) {
 		VMObject *obj = VM_GetObjectFromHandle(c, obj_handle);
 		VM_DeleteObject(c, obj, call_delete);
-		free(obj->members);
+		if (obj->members) {
+			/* the block is kept for the next object of the same class */
+			SobData *sob = ClassHandle_GetSob(c, obj->class_handle);
+			*(void **)obj->members = sob->members_free;
+			sob->members_free = obj->members;
+		}
+		const int generation = (obj->generation + 1) % OBJECT_GENERATIONS;
 		memset(obj, 0, sizeof(VMObject));
-		obj->next_free = c->objects_next_free;
-		c->objects_next_free = obj - c->objects;
+		obj->generation = generation;
+		freeObjectSlot(c, (obj_handle - BASE_HANDLE_OBJECT) & VMHANDLE_INDEX_MASK);
+		--c->objects_count;
 	}
 }
@@ -3,67 +3,91 @@
 #include "util.h"
 #include "vm.h"
 
-static void op_nop(VMContext *) {
+static VMVar *cacheMemberVar(VMContext *c, VMInsn *insn, VMObject *obj) {
+	VMMemberCache *cache = insn->member;
+	if (!cache->ref) {
+		cache->ref = Sob_GetRefMember(c->script->sob_data, insn->num & 0xFFFF);
+	}
+	const int index = VM_GetObjectMemberIndex(c, obj, cache->ref);
+	VMVar *var = Object_GetMemberVar(obj, index);
+	int i = cache->count;
+	if (i < VMINLINECACHE_SIZE) {
+		++cache->count;
+	} else { /* megamorphic, evict the entries in turn */
+		i = cache->next;
+		cache->next = (i + 1) % VMINLINECACHE_SIZE;
+	}
+	cache->class_handle[i] = obj->class_handle;
+	cache->data_index[i] = index;
+	return var;
+}
+
+static inline VMVar *getMemberVar(VMContext *c, VMInsn *insn, VMObject *obj) {
+	const VMMemberCache *cache = insn->member;
+	for (int i = 0; i < cache->count; ++i) {
+		if (cache->class_handle[i] == obj->class_handle) {
+			return &obj->members[cache->data_index[i]];
+		}
+	}
+	return cacheMemberVar(c, insn, obj);
+}
+
+static SobVar *getStaticVar(VMContext *c, VMInsn *insn) {
+	if (!insn->var) {
+		insn->var = VM_GetClassStaticVar(c, c->script->sob_data, insn->num & 0xFFFF);
+	}
+	return insn->var;
 }
 
-static void op_breakhere(VMContext *c) {
+static void op_nop(VMContext *c, VMInsn *insn) {
+}
+
+static void op_breakhere(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_breakhere");
 	c->script->state = SCRIPT_STATE_YIELD;
 }
 
-static void op_jump(VMContext *c) {
+static void op_jump(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_jump");
-	const int32_t pos = READ_LE_UINT32(c->code);
-	c->code += pos - 1;
-	c->script->code_offset += pos - 1;
-
-	const SobData *sob = c->script->sob_data;
-	const uint8_t *start = sob->code_data;
-	const uint8_t *end = start + sob->code_size;
-	if (c->code < start || c->code >= end) {
-		error("Code ptr %p out of range (%p..%p)", c->code, start, end);
+	if (!insn->target) {
+		const SobData *sob = c->script->sob_data;
+		error("Jump offset %d out of range (0..%d)", (int)(insn - sob->insns) + insn->num, sob->code_size);
 	}
+	c->code = insn->target;
 }
 
-static void op_return(VMContext *c) {
+static void op_return(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_return");
 	c->script->state = SCRIPT_STATE_ENDED;
 }
 
-static void op_push_int8(VMContext *c) {
-	const uint8_t value = *c->code++;
+static void op_push_int8(VMContext *c, VMInsn *insn) {
+	const uint8_t value = insn->num;
 	debug(DBG_OPCODES, "op_push_int8 value:%d", value);
-	c->script->code_offset += 1;
 	VM_Push(c, value, VAR_TYPE_INT32);
 }
 
-static void op_push_int32(VMContext *c) {
-	const int value = READ_LE_UINT32(c->code); c->code += 4;
+static void op_push_int32(VMContext *c, VMInsn *insn) {
+	const int value = insn->num;
 	debug(DBG_OPCODES, "op_push_int32 value:%d", value);
-	c->script->code_offset += 4;
 	VM_Push(c, value, VAR_TYPE_INT32);
 }
 
-static void op_push_me(VMContext *c) {
+static void op_push_me(VMContext *c, VMInsn *insn) {
 	VMObject *obj = c->script->obj;
 	if (!obj) {
 		error("push_me called from static method");
 	}
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_push_me num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	VMVar *var = VM_GetObjectMemberVar(c, obj, num & 0xFFFF);
+	const int count = insn->count;
+	VMVar *var = getMemberVar(c, insn, obj);
 	for (int i = 0; i < count; ++i, ++var) {
 		VM_Push(c, var->value, var->type);
 	}
 }
 
-static void op_push_member(VMContext *c) {
+static void op_push_member(VMContext *c, VMInsn *insn) {
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Accessing member variable from a NULL object");
@@ -72,69 +96,55 @@ static void op_push_member(VMContext *c) {
 	if (!obj) {
 		error("Object handle %d was deleted", obj_handle);
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_push_member num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	VMVar *var = VM_GetObjectMemberVar(c, obj, num & 0xFFFF);
+	const int count = insn->count;
+	VMVar *var = getMemberVar(c, insn, obj);
 	for (int i = 0; i < count; ++i, ++var) {
 		VM_Push(c, var->value, var->type);
 	}
 }
 
-static void op_push_local(VMContext *c) {
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_push_local(VMContext *c, VMInsn *insn) {
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_push_local num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
+	const int count = insn->count;
 	const VMVar *var = VM_GetLocalVar(c, num & 0xFFFF);
 	for (int i = 0; i < count; ++i, ++var) {
 		VM_Push(c, var->value, var->type);
 	}
 }
 
-static void op_push_static(VMContext *c) {
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+/* the local index was checked by VM_VerifySob */
+static void op_push_local_unchecked(VMContext *c, VMInsn *insn) {
+	const VMVar *var = &c->script->local_vars[insn->num];
+	VM_Push(c, var->value, var->type);
+}
+
+static void op_push_static(VMContext *c, VMInsn *insn) {
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_push_static num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	const SobVar *var = VM_GetClassStaticVar(c, c->script->sob_data, num & 0xFFFF);
+	const int count = insn->count;
+	const SobVar *var = getStaticVar(c, insn);
 	for (int i = 0; i < count; ++i, ++var) {
 		VM_Push(c, var->value, var->type);
 	}
 }
 
-static void op_push_static_me(VMContext *c) {
+static void op_push_static_me(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_push_static_me");
-	op_push_static(c);
+	op_push_static(c, insn);
 }
 
-static void op_pop(VMContext *c) {
+static void op_pop(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_pop");
 	VM_Pop2(c);
 }
 
-static void op_pop_local(VMContext *c) {
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_pop_local(VMContext *c, VMInsn *insn) {
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_pop_local num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
+	const int count = insn->count;
 	VMVar *var = VM_GetLocalVar(c, num & 0xFFFF);
 	var += count - 1;
 	for (int i = 0; i < count; ++i, --var) {
@@ -145,20 +155,55 @@ static void op_pop_local(VMContext *c) {
 	}
 }
 
-static void op_pop_me(VMContext *c) {
+/* the local index and the type of the value were checked by VM_VerifySob */
+static void op_pop_local_unchecked(VMContext *c, VMInsn *insn) {
+	--c->sp;
+	c->script->local_vars[insn->num].value = c->stack[c->sp].value;
+}
+
+static int compareInt(int op, int a, int b) {
+	switch (op) {
+	case 0x2c:
+		return a == b;
+	case 0x2d:
+		return a != b;
+	case 0x2e:
+		return a <= b;
+	case 0x2f:
+		return a >= b;
+	case 0x30:
+		return a < b;
+	default:
+		return a > b;
+	}
+}
+
+/* push_local, push_int, add_int/sub_int, pop_local fused by Insn_FuseSob */
+static void op_add_local_int(VMContext *c, VMInsn *insn) {
+	const VMInsn *last = insn->target;
+	VMVar *locals = c->script->local_vars;
+	const int value = (insn + insn->len)->num;
+	locals[last->num].value = (insn->type == 0x18) ? locals[insn->num].value + value : locals[insn->num].value - value;
+	c->code = (VMInsn *)last + last->len;
+}
+
+/* push_local, push_int, compare, if_eq/if_neq fused by Insn_FuseSob */
+static void op_if_local_int(VMContext *c, VMInsn *insn) {
+	const VMInsn *last = insn->target;
+	const int res = compareInt(insn->type, c->script->local_vars[insn->num].value, (insn + insn->len)->num);
+	c->code = ((res != 0) == (last->op == 0x28)) ? last->target : (VMInsn *)last + last->len;
+}
+
+static void op_pop_me(VMContext *c, VMInsn *insn) {
 	VMObject *obj = c->script->obj;
 	if (!obj) {
 		error("pop_me called from static method");
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_pop_me num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	VMVar *var = VM_GetObjectMemberVar(c, obj, num & 0xFFFF);
+	const int count = insn->count;
+	VMVar *var = getMemberVar(c, insn, obj);
+	obj->gc_dirty = 1;
 	var += count - 1;
 	for (int i = 0; i < count; ++i, --var) {
 		VMVar st2 = VM_Pop2(c);
@@ -168,7 +213,7 @@ static void op_pop_me(VMContext *c) {
 	}
 }
 
-static void op_pop_member(VMContext *c) {
+static void op_pop_member(VMContext *c, VMInsn *insn) {
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Accessing member variable from a NULL object");
@@ -177,18 +222,13 @@ static void op_pop_member(VMContext *c) {
 	if (!obj) {
 		error("Object handle %d was deleted", obj_handle);
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_pop_member num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	VMVar *var = VM_GetObjectMemberVar(c, obj, num & 0xFFFF);
+	const int count = insn->count;
+	VMVar *var = getMemberVar(c, insn, obj);
+	obj->gc_dirty = 1;
 	var += count - 1;
 	for (int i = 0; i < count; ++i, --var) {
-		VMVar *var = VM_GetObjectMemberVar(c, obj, num);
 		VMVar st2 = VM_Pop2(c);
 		VM_CheckVarType(st2.type);
 		VM_CheckVarType(var->type);
@@ -196,16 +236,11 @@ static void op_pop_member(VMContext *c) {
 	}
 }
 
-static void op_pop_static(VMContext *c) {
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_pop_static(VMContext *c, VMInsn *insn) {
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_pop_static num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	SobVar *var = VM_GetClassStaticVar(c, c->script->sob_data, num & 0xFFFF);
+	const int count = insn->count;
+	SobVar *var = getStaticVar(c, insn);
 	var += count - 1;
 	for (int i = 0; i < count; ++i, --var) {
 		VMVar st = VM_Pop2(c);
@@ -215,39 +250,35 @@ static void op_pop_static(VMContext *c) {
 	}
 }
 
-static void op_pop_static_me(VMContext *c) {
+static void op_pop_static_me(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_pop_static_me");
-	op_pop_static(c);
+	op_pop_static(c, insn);
 }
 
-static void op_call_me(VMContext *c) {
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_call_me(VMContext *c, VMInsn *insn) {
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_call_me num:%d", num);
-	VM_InvokeMethod(c, c->script->sob_data, num, c->script->obj_handle, 0, 0, 0);
+	VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, c->script->obj_handle, 0, 0, 0);
 }
 
-static void op_call_method(VMContext *c) {
+static void op_call_method(VMContext *c, VMInsn *insn) {
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Calling method from NULL object");
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_call_method num:%d obj:%d", num, obj_handle);
-	VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, 0, 0, 0);
+	VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, 0, 0, 0);
 }
 
-static void op_call_static(VMContext *c) {
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_call_static(VMContext *c, VMInsn *insn) {
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_call_static num:%d", num);
-	VM_InvokeMethod(c, c->script->sob_data, num, 0, 0, 1, 0);
+	VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, 0, 0, 1, 0);
 }
 
-static void op_new(VMContext *c) {
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_new(VMContext *c, VMInsn *insn) {
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_new num:%d", num);
 	SobData *sob = c->script->sob_data;
 	SobRefEntry *ref = Sob_GetRefClass(sob, num);
@@ -259,7 +290,7 @@ static void op_new(VMContext *c) {
 	VM_Push(c, obj_handle, VAR_TYPE_OBJECT);
 }
 
-static void op_add_int(VMContext *c) {
+static void op_add_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_add_int");
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
@@ -267,7 +298,7 @@ static void op_add_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_sub_int(VMContext *c) {
+static void op_sub_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_sub_int");
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
@@ -275,7 +306,7 @@ static void op_sub_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_mul_int(VMContext *c) {
+static void op_mul_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_mul_int");
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
@@ -283,7 +314,7 @@ static void op_mul_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_div_int(VMContext *c) {
+static void op_div_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_div_int");
 	VMVar b = VM_Pop2(c);
 	int div = b.value;
@@ -295,7 +326,7 @@ static void op_div_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_neg_int(VMContext *c) {
+static void op_neg_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_neg_int");
 	VMVar st = VM_Pop2(c);
 	if (st.type > VAR_TYPE_INT32) {
@@ -304,75 +335,63 @@ static void op_neg_int(VMContext *c) {
 	VM_Push(c, -st.value, st.type);
 }
 
-static void op_start_method(VMContext *c) {
-	const int type = *c->code++;
-	++c->script->code_offset;
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_start_method(VMContext *c, VMInsn *insn) {
+	const int type = insn->type;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_start_method num:%d type:%d", num, type);
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Starting script from a NULL object");
 	}
 	if (type == 2) {
-		const int ret = VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, 2, 0, 0);
+		const int ret = VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, 2, 0, 0);
 		VM_Push(c, ret, VAR_TYPE_INT32);
 	} else {
-		VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, type, 0, 0);
+		VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, type, 0, 0);
 	}
 }
 
-static void op_start_static(VMContext *c) {
-	const int type = *c->code++;
-	++c->script->code_offset;
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_start_static(VMContext *c, VMInsn *insn) {
+	const int type = insn->type;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_start_static num:%d type:%d", num, type);
 	if (type == 2) {
-		const int ret = VM_InvokeMethod(c, c->script->sob_data, num, 0, 2, 1, 0);
+		const int ret = VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, 0, 2, 1, 0);
 		VM_Push(c, ret, VAR_TYPE_INT32);
 	} else {
-		VM_InvokeMethod(c, c->script->sob_data, num, 0, type, 1, 0);
+		VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, 0, type, 1, 0);
 	}
 }
 
-static void op_start_me(VMContext *c) {
-	const int type = *c->code++;
-	++c->script->code_offset;
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_start_me(VMContext *c, VMInsn *insn) {
+	const int type = insn->type;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_start_me num:%d type:%d", num, type);
 	if (type == 2) {
-		const int ret = VM_InvokeMethod(c, c->script->sob_data, num, c->script->obj_handle, 2, 0, 0);
+		const int ret = VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, c->script->obj_handle, 2, 0, 0);
 		VM_Push(c, ret, VAR_TYPE_INT32);
 	} else {
-		VM_InvokeMethod(c, c->script->sob_data, num, c->script->obj_handle, type, 0, 0);
+		VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, c->script->obj_handle, type, 0, 0);
 	}
 }
 
-static void op_if_eq(VMContext *c) {
+static void op_if_eq(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
 	debug(DBG_OPCODES, "op_if_eq");
 	if (st.value != 0) {
-		op_jump(c);
-	} else {
-		c->code += 4;
-		c->script->code_offset += 4;
+		op_jump(c, insn);
 	}
 }
 
-static void op_if_neq(VMContext *c) {
+static void op_if_neq(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
 	debug(DBG_OPCODES, "op_if_neq");
 	if (st.value == 0) {
-		op_jump(c);
-	} else {
-		c->code += 4;
-		c->script->code_offset += 4;
+		op_jump(c, insn);
 	}
 }
 
-static void op_and(VMContext *c) {
+static void op_and(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_and");
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
@@ -380,7 +399,7 @@ static void op_and(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_or(VMContext *c) {
+static void op_or(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_or");
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
@@ -388,7 +407,7 @@ static void op_or(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_eq_int(VMContext *c) {
+static void op_eq_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value == b.value);
@@ -396,7 +415,7 @@ static void op_eq_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_neq_int(VMContext *c) {
+static void op_neq_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value != b.value);
@@ -404,7 +423,7 @@ static void op_neq_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_leq_int(VMContext *c) {
+static void op_leq_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value <= b.value);
@@ -412,7 +431,7 @@ static void op_leq_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_geq_int(VMContext *c) {
+static void op_geq_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value >= b.value);
@@ -420,7 +439,7 @@ static void op_geq_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_lt_int(VMContext *c) {
+static void op_lt_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value < b.value);
@@ -428,7 +447,7 @@ static void op_lt_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_gt_int(VMContext *c) {
+static void op_gt_int(VMContext *c, VMInsn *insn) {
 	VMVar b = VM_Pop2(c);
 	VMVar a = VM_Pop2(c);
 	const int res = (a.value > b.value);
@@ -436,10 +455,9 @@ static void op_gt_int(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_push_local_array(VMContext *c) {
+static void op_push_local_array(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_push_local_array num:%d", num);
 	const VMVar *var = VM_GetLocalVar(c, num & 0xFFFF);
 	int type = var->type & 0xFFFF;
@@ -460,17 +478,12 @@ static void op_push_local_array(VMContext *c) {
 	}
 }
 
-static void op_pop_static_array(VMContext *c) {
+static void op_pop_static_array(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const uint32_t num = insn->num;
 	debug(DBG_OPCODES, "op_pop_static_array num:%d", num);
-	int count = 1;
-	if (num & 0xFFFF0000) {
-		assert((num & 0xFF000000) == 0);
-		count = (num >> 16) & 0xFF;
-	}
-	SobVar *var = VM_GetClassStaticVar(c, c->script->sob_data, num & 0xFFFF);
+	const int count = insn->count;
+	SobVar *var = getStaticVar(c, insn);
 	var += count - 1;
 	for (int i = 0; i < count; ++i, --var) {
 		VMVar st2 = VM_Pop2(c);
@@ -490,17 +503,16 @@ static void op_pop_static_array(VMContext *c) {
 	}
 }
 
-static void op_pop_static_me_array(VMContext *c) {
-	op_pop_static_array(c);
+static void op_pop_static_me_array(VMContext *c, VMInsn *insn) {
+	op_pop_static_array(c, insn);
 }
 
-static void op_pop_me_array(VMContext *c) {
+static void op_pop_me_array(VMContext *c, VMInsn *insn) {
 	VMObject *obj = c->script->obj;
 	if (!obj) {
 		error("pop_me_array called from static method");
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_pop_me_array num:%d", num);
 
 	const int x = VM_PopInt32(c);
@@ -508,7 +520,7 @@ static void op_pop_me_array(VMContext *c) {
 	if (num & 0xFFFF0000) {
 		error("Unimplemented op_pop_me_array num:0x%x", num);
 	} else {
-		VMVar *var = VM_GetObjectMemberVar(c, obj, num);
+		VMVar *var = getMemberVar(c, insn, obj);
 		VMVar st2 = VM_Pop2(c);
 		VM_CheckVarType(var->type);
 		VM_CheckVarType(st2.type);
@@ -526,19 +538,18 @@ static void op_pop_me_array(VMContext *c) {
 	}
 }
 
-static void op_push_me1(VMContext *c) {
+static void op_push_me1(VMContext *c, VMInsn *insn) {
 	VMObject *obj = c->script->obj;
 	if (!obj) {
 		error("push_me1 called from static method");
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_push_me1 num:%d", num);
 
 	if (num & 0xFFFF0000) {
 		error("Unimplemented op_push_me1 num:0x%x", num);
 	} else {
-		VMVar *var = VM_GetObjectMemberVar(c, obj, num);
+		VMVar *var = getMemberVar(c, insn, obj);
 		const int x = VM_PopInt32(c);
 		int type = var->type & 0xFFFF;
 		if (type & 0x100) {
@@ -556,7 +567,7 @@ static void op_push_me1(VMContext *c) {
 	}
 }
 
-static void op_push_member_array(VMContext *c) {
+static void op_push_member_array(VMContext *c, VMInsn *insn) {
 	const int x = VM_PopInt32(c);
 
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
@@ -567,14 +578,13 @@ static void op_push_member_array(VMContext *c) {
 	if (!obj) {
 		error("Object handle %d was deleted", obj_handle);
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_push_member_array num:%d", num);
 
 	if (num & 0xFFFF0000) {
 		error("Unimplemented op_push_member_array num:0x%x", num);
 	} else {
-		VMVar *var = VM_GetObjectMemberVar(c, obj, num & 0xFFFF);
+		VMVar *var = getMemberVar(c, insn, obj);
 		int type = var->type & 0xFFFF;
 		if (type & 0x100) {
 			type &= ~0x100;
@@ -591,17 +601,16 @@ static void op_push_member_array(VMContext *c) {
 	}
 }
 
-static void op_push_static_array(VMContext *c) {
+static void op_push_static_array(VMContext *c, VMInsn *insn) {
 	const int x = VM_PopInt32(c);
 
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_push_static_array num:%d", num);
 
 	if (num & 0xFFFF0000) {
 		error("Unimplemented op_push_static_array num:0x%x", num);
 	} else {
-		const SobVar *var = VM_GetClassStaticVar(c, c->script->sob_data, num);
+		const SobVar *var = getStaticVar(c, insn);
 		int type = var->type & 0xFFFF;
 		if (type & 0x100) {
 			type &= ~0x100;
@@ -618,11 +627,10 @@ static void op_push_static_array(VMContext *c) {
 	}
 }
 
-static void op_pop_local_array(VMContext *c) {
+static void op_pop_local_array(VMContext *c, VMInsn *insn) {
 	const int x = VM_PopInt32(c);
 
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_pop_local_array num:%d", num);
 
 	if (num & 0xFFFF0000) {
@@ -646,22 +654,21 @@ static void op_pop_local_array(VMContext *c) {
 	}
 }
 
-static void op_push_static_me_array(VMContext *c) {
+static void op_push_static_me_array(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_push_static_me_array");
-	op_push_static_array(c);
+	op_push_static_array(c, insn);
 }
 
-static void op_push_string(VMContext *c) {
-	const int32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_push_string(VMContext *c, VMInsn *insn) {
+	const int32_t num = insn->num;
 	debug(DBG_OPCODES, "op_push_string num:%d", num);
-	const char *str = Sob_GetString(c->script->sob_data, num);
+	const char *str = insn->str ? insn->str : Sob_GetString(c->script->sob_data, num);
 	VMArray *array = Array_New(c);
-	Array_SetString(array, str);
+	Array_SetConstString(array, str, strlen(str));
 	VM_Push(c, array->handle, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_add_str(VMContext *c) {
+static void op_add_str(VMContext *c, VMInsn *insn) {
 	VMVar st2 = VM_Pop2(c);
 	VMVar st1 = VM_Pop2(c);
 	if (st1.type != (0x10000 | VAR_TYPE_CHAR) && st1.value != 0 && (st1.type & 0xFF) != 12 && (st1.type & 0xFF) != 10) {
@@ -674,31 +681,23 @@ static void op_add_str(VMContext *c) {
 	VM_Push(c, array, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_syscall(VMContext *c) {
-	const int32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_syscall(VMContext *c, VMInsn *insn) {
+	const int32_t num = insn->num;
 	debug(DBG_OPCODES, "op_syscall num:%d", num);
 	const int x = VM_FindSyscallIndex(c, num);
 	assert(x != -1);
 	VM_ExecuteSyscallByIndex(c, x);
-	uint8_t *code = (uint8_t *)c->code;
-	code[-5] = 0xB6; /* op_fast_syscall */
-	WRITE_LE_UINT32(code - 4, x);
 }
 
-static void op_fsyscall(VMContext *c) {
-	const int32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_fsyscall(VMContext *c, VMInsn *insn) {
+	const int32_t num = insn->num;
 	debug(DBG_OPCODES, "op_fsyscall num:%d", num);
 	const int x = VM_FindSyscallIndex(c, num);
 	assert(x != -1);
 	VM_ExecuteSyscallByIndex(c, x);
-	uint8_t *code = (uint8_t *)c->code;
-	code[-5] = 0xB7; /* op_fast_fsyscall */
-	WRITE_LE_UINT32(code - 4, x);
 }
 
-static void op_dim(VMContext *c) {
+static void op_dim(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_dim");
 	VMVar st = VM_Pop2(c);
 	if (st.type & 0x10000) {
@@ -711,7 +710,7 @@ static void op_dim(VMContext *c) {
 	}
 }
 
-static void op_quit(VMContext *c) {
+static void op_quit(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_quit");
 	int ret = 0;
 	if (c->gameID >= GID_MOOP) {
@@ -720,7 +719,7 @@ static void op_quit(VMContext *c) {
 	exit(ret);
 }
 
-static void op_col_lower(VMContext *c) {
+static void op_col_lower(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_col_lower");
 	VMVar v0 = VM_Pop2(c);
 	if ((v0.type & 0x10000) == 0) {
@@ -730,7 +729,7 @@ static void op_col_lower(VMContext *c) {
 	VM_Push(c, array->col_lower, VAR_TYPE_INT32);
 }
 
-static void op_col_upper(VMContext *c) {
+static void op_col_upper(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_col_upper");
 	VMVar v0 = VM_Pop2(c);
 	if ((v0.type & 0x10000) == 0) {
@@ -740,7 +739,7 @@ static void op_col_upper(VMContext *c) {
 	VM_Push(c, array->col_upper, VAR_TYPE_INT32);
 }
 
-static void op_col_size(VMContext *c) {
+static void op_col_size(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_col_size");
 	VMVar v0 = VM_Pop2(c);
 	if ((v0.type & 0x10000) == 0) {
@@ -750,7 +749,7 @@ static void op_col_size(VMContext *c) {
 	VM_Push(c, array->col_upper - array->col_lower + 1, VAR_TYPE_INT32);
 }
 
-static void op_mod(VMContext *c) {
+static void op_mod(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_mod");
 	VMVar v0 = VM_Pop2(c);
 	int div = v0.value;
@@ -762,7 +761,7 @@ static void op_mod(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_rand_int(VMContext *c) {
+static void op_rand_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_rand_int");
 	VMVar v0 = VM_Pop2(c);
 	VMVar v1 = VM_Pop2(c);
@@ -781,7 +780,7 @@ static void op_rand_int(VMContext *c) {
 	VM_Push(c, r, v1.type);
 }
 
-static void op_strlen(VMContext *c) {
+static void op_strlen(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_strlen");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -792,13 +791,13 @@ static void op_strlen(VMContext *c) {
 	VM_Push(c, len, VAR_TYPE_INT32);
 }
 
-static void op_not_int(VMContext *c) {
+static void op_not_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_not_int");
 	VMVar st = VM_Pop2(c);
 	VM_Push(c, st.value == 0, VAR_TYPE_INT32);
 }
 
-static void op_copy1(VMContext *c) {
+static void op_copy1(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_copy1");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -806,10 +805,10 @@ static void op_copy1(VMContext *c) {
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
 	const int handle = Array_Copy1(c, array);
-	VM_Push(c, handle, 0x10000 | array->type);
+	VM_Push(c, handle, 0x10000 | Array_GetInfo(array)->type);
 }
 
-static void op_range1(VMContext *c) {
+static void op_range1(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_range1");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -819,10 +818,10 @@ static void op_range1(VMContext *c) {
 	VMVar end = VM_Pop2(c);
 	VMVar start = VM_Pop2(c);
 	const int handle = Array_Range1(c, array, start.value, end.value);
-	VM_Push(c, handle, 0x10000 | array->type);
+	VM_Push(c, handle, 0x10000 | Array_GetInfo(array)->type);
 }
 
-static void op_swap(VMContext *c) {
+static void op_swap(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_swap");
 	VMVar a = VM_Pop2(c);
 	VMVar b = VM_Pop2(c);
@@ -830,7 +829,7 @@ static void op_swap(VMContext *c) {
 	VM_Push(c, b.value, b.type);
 }
 
-static void op_dim2(VMContext *c) {
+static void op_dim2(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_dim2");
 	VMVar st1 = VM_Pop2(c);
 	if ((st1.type & 0x10000) == 0) {
@@ -843,41 +842,41 @@ static void op_dim2(VMContext *c) {
 	VM_Push(c, array->handle, st1.type);
 }
 
-static void op_row_lower(VMContext *c) {
+static void op_row_lower(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_row_lower");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
 		error("Calling array operator on type %s", VM_GetVarTypeName(st.type));
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
-	VM_Push(c, array->row_lower, VAR_TYPE_INT32);
+	VM_Push(c, Array_GetInfo(array)->row_lower, VAR_TYPE_INT32);
 }
 
-static void op_row_upper(VMContext *c) {
+static void op_row_upper(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_row_upper");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
 		error("Calling array operator on type %s", VM_GetVarTypeName(st.type));
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
-	VM_Push(c, array->row_upper, VAR_TYPE_INT32);
+	VM_Push(c, Array_GetInfo(array)->row_upper, VAR_TYPE_INT32);
 }
 
-static void op_row_size(VMContext *c) {
+static void op_row_size(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_row_size");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
 		error("Calling array operator on type %s", VM_GetVarTypeName(st.type));
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
-	VM_Push(c, array->row_upper - array->row_lower + 1, VAR_TYPE_INT32);
+	const VMArrayInfo *info = Array_GetInfo(array);
+	VM_Push(c, info->row_upper - info->row_lower + 1, VAR_TYPE_INT32);
 }
 
-static void op_poppush_array(VMContext *c) {
+static void op_poppush_array(VMContext *c, VMInsn *insn) {
 	int type = 7;
 	if (c->gameID >= GID_MONSTERS) {
-		type = READ_LE_UINT32(c->code); c->code += 4;
-		c->script->code_offset += 4;
+		type = insn->num;
 	}
 	VMVar st = VM_Pop2(c);
 	debug(DBG_OPCODES, "op_poppush_array %d", st.value);
@@ -888,13 +887,13 @@ static void op_poppush_array(VMContext *c) {
 	Array_Dim(array, type, 1, st.value);
 	for (int i = st.value; i >= 1; --i) {
 		VMVar st2 = VM_Pop2(c);
-		assert(array->struct_size == 0);
+		assert(Array_GetInfo(array)->struct_size == 0);
 		Array_Set(array, i, st2.value);
 	}
 	VM_Push(c, array->handle, 0x10000 | 12);
 }
 
-static void op_band(VMContext *c) {
+static void op_band(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_band");
 	VMVar b = VM_Pop2(c);
 	if (b.type > VAR_TYPE_INT32) {
@@ -907,7 +906,7 @@ static void op_band(VMContext *c) {
 	VM_Push(c, a.value & b.value, a.type);
 }
 
-static void op_bor(VMContext *c) {
+static void op_bor(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_bor");
 	VMVar b = VM_Pop2(c);
 	if (b.type > VAR_TYPE_INT32) {
@@ -921,28 +920,28 @@ static void op_bor(VMContext *c) {
 }
 
 
-static void op_stop(VMContext *c) {
+static void op_stop(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_stop");
 	VMVar st = VM_Pop2(c);
 	VMThread *thread = c->script->thread;
 	VM_StopThread(c, st.value, thread->handle);
 }
 
-static void op_stop_me(VMContext *c) {
+static void op_stop_me(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_stop_me");
 	VMThread *thread = c->script->thread;
 	thread->state = SCRIPT_STATE_DEAD;
 	c->script->state = SCRIPT_STATE_ENDED;
 }
 
-static void op_running(VMContext *c) {
+static void op_running(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_running");
 	VMVar st = VM_Pop2(c);
 	const int count = VM_CountThreads(c, st.value);
 	VM_Push(c, count, VAR_TYPE_INT32);
 }
 
-static void op_threadid(VMContext *c) {
+static void op_threadid(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
 	debug(DBG_OPCODES, "op_threadid id:%d", st.value);
 	if (st.value == -1) {
@@ -953,7 +952,7 @@ static void op_threadid(VMContext *c) {
 	}
 }
 
-static void op_min_int(VMContext *c) {
+static void op_min_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_min_int");
 	VMVar b = VM_Pop2(c);
 	if (b.type > VAR_TYPE_INT32) {
@@ -966,7 +965,7 @@ static void op_min_int(VMContext *c) {
 	VM_Push(c, a.value < b.value ? a.value : b.value, a.type);
 }
 
-static void op_max_int(VMContext *c) {
+static void op_max_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_max_int");
 	VMVar b = VM_Pop2(c);
 	if (b.type > VAR_TYPE_INT32) {
@@ -979,13 +978,13 @@ static void op_max_int(VMContext *c) {
 	VM_Push(c, a.value > b.value ? a.value : b.value, a.type);
 }
 
-static void op_dup(VMContext *c) {
+static void op_dup(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_dup");
 	VMVar a = VM_Top2(c);
 	VM_Push(c, a.value, a.type);
 }
 
-static void op_streq(VMContext *c) {
+static void op_streq(VMContext *c, VMInsn *insn) {
 	VMVar st2 = VM_Pop2(c);
 	VMVar st1 = VM_Pop2(c);
 	if (st1.type != (0x10000 | VAR_TYPE_CHAR) && st1.value != 0 && (st1.type & 0xFF) != 12 && (st1.type & 0xFF) != 10) {
@@ -998,19 +997,19 @@ static void op_streq(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_insert_upper(VMContext *c) {
+static void op_insert_upper(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_insert_upper");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
 		error("Calling array operator on type %s", VM_GetVarTypeName(st.type));
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
-	assert(array->struct_size == 0);
+	assert(Array_GetInfo(array)->struct_size == 0);
 	VMVar st2 = VM_Pop2(c);
 	Array_InsertUpper(array, st2.value);
 }
 
-static void op_delete_lower(VMContext *c) {
+static void op_delete_lower(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_delete_lower");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1018,10 +1017,10 @@ static void op_delete_lower(VMContext *c) {
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
 	const int value = Array_DeleteLower(array);
-	VM_Push(c, value, array->type);
+	VM_Push(c, value, Array_GetInfo(array)->type);
 }
 
-static void op_delete_upper(VMContext *c) {
+static void op_delete_upper(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_delete_upper");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1029,12 +1028,11 @@ static void op_delete_upper(VMContext *c) {
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
 	const int value = Array_DeleteUpper(array);
-	VM_Push(c, value, array->type);
+	VM_Push(c, value, Array_GetInfo(array)->type);
 }
 
-static void op_class_handle(VMContext *c) {
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_class_handle(VMContext *c, VMInsn *insn) {
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_class_handle num:%d", num);
 	SobData *sob = c->script->sob_data;
 	SobRefEntry *ref = Sob_GetRefClass(sob, num);
@@ -1045,7 +1043,7 @@ static void op_class_handle(VMContext *c) {
 	VM_Push(c, ref->class_handle, VAR_TYPE_INT32);
 }
 
-static void op_class_name(VMContext *c) {
+static void op_class_name(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_class_name");
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
@@ -1061,7 +1059,7 @@ static void op_class_name(VMContext *c) {
 	VM_Push(c, array->handle, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_class_type(VMContext *c) {
+static void op_class_type(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_class_type");
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
@@ -1074,25 +1072,25 @@ static void op_class_type(VMContext *c) {
 	VM_Push(c, obj->class_handle, VAR_TYPE_INT32);
 }
 
-static void op_delete(VMContext *c) {
+static void op_delete(VMContext *c, VMInsn *insn) {
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	ObjectHandle_Delete(c, obj_handle, 1);
 }
 
-static void op_itof(VMContext *c) {
+static void op_itof(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_itof");
 	VMVar st = VM_Pop2(c);
 	float f = st.value;
 	VM_PushFloat(c, f);
 }
 
-static void op_ftoi(VMContext *c) {
+static void op_ftoi(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_ftoi");
 	const float f = VM_PopFloat(c);
 	VM_Push(c, (int)f, VAR_TYPE_INT32);
 }
 
-static void op_itos(VMContext *c) {
+static void op_itos(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_itos");
 	VMVar st = VM_Pop2(c);
 	char buffer[256];
@@ -1102,7 +1100,7 @@ static void op_itos(VMContext *c) {
 	VM_Push(c, array->handle, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_ftos(VMContext *c) {
+static void op_ftos(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_ftos");
 	const float f = VM_PopFloat(c);
 	char buffer[256];
@@ -1112,14 +1110,14 @@ static void op_ftos(VMContext *c) {
 	VM_Push(c, array->handle, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_stoi(VMContext *c) {
+static void op_stoi(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_stoi");
 	VMVar st = VM_Pop2(c);
 	const char *p = ArrayHandle_GetString(c, st.value);
 	VM_Push(c, p ? atoi(p) : 0, VAR_TYPE_INT32);
 }
 
-static void op_stof(VMContext *c) {
+static void op_stof(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_stof");
 	VMVar st = VM_Pop2(c);
 	const char *p = ArrayHandle_GetString(c, st.value);
@@ -1127,7 +1125,7 @@ static void op_stof(VMContext *c) {
 	VM_PushFloat(c, f);
 }
 
-static void op_add_float(VMContext *c) {
+static void op_add_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_add_float");
 	float f2 = VM_PopFloat(c);
 	float f1 = VM_PopFloat(c);
@@ -1135,7 +1133,7 @@ static void op_add_float(VMContext *c) {
 	VM_PushFloat(c, f1);
 }
 
-static void op_sub_float(VMContext *c) {
+static void op_sub_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_sub_float");
 	float f2 = VM_PopFloat(c);
 	float f1 = VM_PopFloat(c);
@@ -1143,7 +1141,7 @@ static void op_sub_float(VMContext *c) {
 	VM_PushFloat(c, f1);
 }
 
-static void op_mul_float(VMContext *c) {
+static void op_mul_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_mul_float");
 	float f2 = VM_PopFloat(c);
 	float f1 = VM_PopFloat(c);
@@ -1151,7 +1149,7 @@ static void op_mul_float(VMContext *c) {
 	VM_PushFloat(c, f1);
 }
 
-static void op_div_float(VMContext *c) {
+static void op_div_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_div_float");
 	float f2 = VM_PopFloat(c);
 	if (f2 == 0.) {
@@ -1162,7 +1160,7 @@ static void op_div_float(VMContext *c) {
 	VM_PushFloat(c, f1);
 }
 
-static void op_eq_float(VMContext *c) {
+static void op_eq_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_eq_float");
 	float f2 = VM_PopFloat(c);
 	float f1 = VM_PopFloat(c);
@@ -1170,7 +1168,7 @@ static void op_eq_float(VMContext *c) {
 	VM_PushFloat(c, res);
 }
 
-static void op_neq_float(VMContext *c) {
+static void op_neq_float(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_neq_float");
 	float f2 = VM_PopFloat(c);
 	float f1 = VM_PopFloat(c);
@@ -1178,15 +1176,14 @@ static void op_neq_float(VMContext *c) {
 	VM_PushFloat(c, res);
 }
 
-static void op_push_float(VMContext *c) {
-	const int val = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
-	float f = *(const float *)&val;
+static void op_push_float(VMContext *c, VMInsn *insn) {
+	float f;
+	memcpy(&f, &insn->num, sizeof(f));
 	debug(DBG_OPCODES, "op_push_float %f", f);
 	VM_PushFloat(c, f);
 }
 
-static void op_start_callback(VMContext *c) {
+static void op_start_callback(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_start_callback");
 	const int array = VM_Pop(c, 0x10000 | VAR_TYPE_CHAR);
 	const char *name = ArrayHandle_GetString(c, array);
@@ -1194,49 +1191,46 @@ static void op_start_callback(VMContext *c) {
 	VM_StartCallback(c, st.value, name);
 }
 
-static void op_call_parent(VMContext *c) {
+static void op_call_parent(VMContext *c, VMInsn *insn) {
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Calling method from NULL object");
 	}
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_call_parent num:%d", num);
-	VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, 0, 0, 1);
+	VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, 0, 0, 1);
 }
 
-static void op_start_parent(VMContext *c) {
-	const int type = *c->code++;
-	++c->script->code_offset;
-	const int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_start_parent(VMContext *c, VMInsn *insn) {
+	const int type = insn->type;
+	const int num = insn->num;
 	debug(DBG_OPCODES, "op_start_parent num:%d type:%d", num, type);
 	const int obj_handle = VM_Pop(c, VAR_TYPE_OBJECT);
 	if (obj_handle == 0) {
 		error("Calling method from NULL object");
 	}
 	if (type == 2) {
-		const int ret = VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, 2, 0, 1);
+		const int ret = VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, 2, 0, 1);
 		VM_Push(c, ret, VAR_TYPE_INT32);
 	} else {
-		VM_InvokeMethod(c, c->script->sob_data, num, obj_handle, type, 0, 1);
+		VM_InvokeMethodCached(c, insn->method, c->script->sob_data, num, obj_handle, type, 0, 1);
 	}
 }
 
-static void op_new_expr(VMContext *c) {
+static void op_new_expr(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
 	const int class_handle = st.value;
 	debug(DBG_OPCODES, "op_new_expr class:%d", class_handle);
 	const int obj_handle = ObjectHandle_Create(c, class_handle);
 	SobData *sob = ClassHandle_GetSob(c, class_handle);
-	const int num = Sob_FindMethod(sob, "_new_()V");
+	const int num = sob->new_method;
 	if (num != 0) {
 		VM_InvokeMethod(c, sob, num, obj_handle, 0, 0, 0);
 	}
 	VM_Push(c, obj_handle, VAR_TYPE_OBJECT);
 }
 
-static void op_array_find(VMContext *c) {
+static void op_array_find(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_array_find");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1248,14 +1242,14 @@ static void op_array_find(VMContext *c) {
 	VM_Push(c, res, VAR_TYPE_INT32);
 }
 
-static void op_breakmany(VMContext *c) {
+static void op_breakmany(VMContext *c, VMInsn *insn) {
 	const int count = VM_PopInt32(c);
 	debug(DBG_OPCODES, "op_breakmany count:%d", count);
 	c->script->thread->break_counter = count;
 	c->script->state = SCRIPT_STATE_YIELD;
 }
 
-static void op_breaktime(VMContext *c) {
+static void op_breaktime(VMContext *c, VMInsn *insn) {
 	const float delta = VM_PopFloat(c);
 	debug(DBG_OPCODES, "op_breaktime delta:%f", delta);
 	c->script->thread->break_time = (*c->get_timer)() + (int)(delta * 1000.);
@@ -1263,30 +1257,30 @@ static void op_breaktime(VMContext *c) {
 	c->script->state = SCRIPT_STATE_YIELD;
 }
 
-static void op_delete_array(VMContext *c) {
+static void op_delete_array(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_delete_array");
 	VMVar st = VM_Pop2(c);
 	ArrayHandle_Delete(c, st.value);
 }
 
-static void op_setthreadid(VMContext *c) {
+static void op_setthreadid(VMContext *c, VMInsn *insn) {
 	const int id = VM_PopInt32(c);
 	debug(DBG_OPCODES, "op_setthreadid id:%d", id);
 	c->script->thread->id = id;
 }
 
-static void op_setthreadorder(VMContext *c) {
+static void op_setthreadorder(VMContext *c, VMInsn *insn) {
 	const int order = VM_PopInt32(c);
 	debug(DBG_OPCODES, "op_setthreadorder order:%d", order);
 	c->script->thread->order = order;
 }
 
-static void op_call_callback(VMContext *c) {
+static void op_call_callback(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_call_callback");
-	op_start_callback(c);
+	op_start_callback(c, insn);
 }
 
-static void op_delete_index(VMContext *c) {
+static void op_delete_index(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_delete_index");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1298,7 +1292,7 @@ static void op_delete_index(VMContext *c) {
 	VM_Push(c, ret, VAR_TYPE_INT32);
 }
 
-static void op_check_index(VMContext *c) {
+static void op_check_index(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_check_index");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1310,7 +1304,7 @@ static void op_check_index(VMContext *c) {
 	VM_Push(c, ret, VAR_TYPE_INT32);
 }
 
-static void op_strcat(VMContext *c) {
+static void op_strcat(VMContext *c, VMInsn *insn) {
 	VMVar st2 = VM_Pop2(c);
 	VMVar st1 = VM_Pop2(c);
 	if (st1.type != (0x10000 | VAR_TYPE_CHAR) && st1.value != 0 && (st1.type & 0xFF) != 12 && (st1.type & 0xFF) != 10) {
@@ -1322,32 +1316,32 @@ static void op_strcat(VMContext *c) {
 	ArrayHandle_ConcatString(c, st1.value, st2.value);
 }
 
-static void op_assert(VMContext *c) {
+static void op_assert(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_assert");
 	VM_Pop2(c);
 	VM_Pop2(c);
 }
 
-static void op_gotodefine(VMContext *c) {
+static void op_gotodefine(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_gotodefine");
 	VMVar st = VM_Pop2(c);
-	const uint32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	const uint32_t num = insn->num;
 	if (num == 0) {
 		Thread_Define(c->script->thread, st.value, 0);
 	} else {
-		Thread_Define(c->script->thread, st.value, c->script->code_offset + num - 5);
+		const uint32_t offset = insn - c->script->sob_data->insns;
+		Thread_Define(c->script->thread, st.value, offset + num);
 	}
 }
 
-static void op_gotothread(VMContext *c) {
+static void op_gotothread(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_gotothread");
 	VMVar st2 = VM_Pop2(c);
 	VMVar st1 = VM_Pop2(c);
 	ThreadHandle_GoTo(c, st1.value, st2.value);
 }
 
-static void op_dim_int(VMContext *c) {
+static void op_dim_int(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_dim_int");
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
@@ -1360,34 +1354,31 @@ static void op_dim_int(VMContext *c) {
 	}
 }
 
-static void op_array_rand(VMContext *c) {
+static void op_array_rand(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
 	if ((st.type & 0x10000) == 0) {
 		error("Calling array operator on type %s", VM_GetVarTypeName(st.type));
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, st.value);
 	int value = Array_Rand(array);
-	VM_Push(c, value, array->type);
+	VM_Push(c, value, Array_GetInfo(array)->type);
 }
 
-static void op_fast_syscall(VMContext *c) {
-	const int32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_fast_syscall(VMContext *c, VMInsn *insn) {
+	const int32_t num = insn->num;
 	debug(DBG_OPCODES, "op_fast_syscall num:%d", num);
 	VM_ExecuteSyscallByIndex(c, num);
 }
 
-static void op_fast_fsyscall(VMContext *c) {
-	const int32_t num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+static void op_fast_fsyscall(VMContext *c, VMInsn *insn) {
+	const int32_t num = insn->num;
 	debug(DBG_OPCODES, "op_fast_fsyscall num:%d", num);
 	VM_ExecuteSyscallByIndex(c, num);
 }
 
-static void op_push_raw_local_array(VMContext *c) {
+static void op_push_raw_local_array(VMContext *c, VMInsn *insn) {
 	VMVar st = VM_Pop2(c);
-	int num = READ_LE_UINT32(c->code); c->code += 4;
-	c->script->code_offset += 4;
+	int num = insn->num;
 	debug(DBG_OPCODES, "op_push_raw_local_array num:%d", num);
         num &= 0xFFFF;
 	const VMVar *var = VM_GetLocalVar(c, num);
@@ -1397,21 +1388,21 @@ static void op_push_raw_local_array(VMContext *c) {
 		type |= 0x10000;
 	}
 	VMArray *array = VM_GetArrayFromHandle(c, var->value);
-	if (array->dimension == 2) {
+	if (Array_GetInfo(array)->dimension == 2) {
 		error("Accessing [n,n] as [n]");
 	}
 	const int value = Array_Get(array, st.value);
 	VM_Push(c, value, type);
 }
 
-static void op_classname_handle(VMContext *c) {
+static void op_classname_handle(VMContext *c, VMInsn *insn) {
 	const char *name = VM_PopString(c);
 	debug(DBG_OPCODES, "op_classname_handle name:'%s'", name);
 	const int num = VM_FindOrLoadClass(c, name, 0);
 	VM_Push(c, num, VAR_TYPE_INT32);
 }
 
-static void op_format_string(VMContext *c) {
+static void op_format_string(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_format_string");
 	const int array_handle = VM_Pop(c, 0x10000 | VAR_TYPE_CHAR);
 	const char *fmt = ArrayHandle_GetString(c, array_handle);
@@ -1422,16 +1413,17 @@ static void op_format_string(VMContext *c) {
 		args[i] = VM_Pop2(c);
 	}
 	char buffer[1024];
+	int len = 0;
 #define ARG(c, x) (args[x].type == (0x10000 | VAR_TYPE_CHAR) ? ArrayHandle_GetString(c, args[x].value) : args[x].value)
 	switch (count) {
 	case 1:
-		snprintf(buffer, sizeof(buffer), fmt, ARG(c, 0));
+		len = snprintf(buffer, sizeof(buffer), fmt, ARG(c, 0));
 		break;
 	case 2:
-		snprintf(buffer, sizeof(buffer), fmt, ARG(c, 1), ARG(c, 0));
+		len = snprintf(buffer, sizeof(buffer), fmt, ARG(c, 1), ARG(c, 0));
 		break;
 	case 3:
-		snprintf(buffer, sizeof(buffer), fmt, ARG(c, 2), ARG(c, 1), ARG(c, 0));
+		len = snprintf(buffer, sizeof(buffer), fmt, ARG(c, 2), ARG(c, 1), ARG(c, 0));
 		break;
 	default:
 		error("Unhandled op_format_string args_count:%d", count);
@@ -1439,34 +1431,34 @@ static void op_format_string(VMContext *c) {
 	}
 #undef ARG
 	debug(DBG_OPCODES, "op_format_string s:'%s'", buffer);
+	if (len < 0) {
+		len = 0;
+		buffer[0] = 0;
+	} else if (len >= (int)sizeof(buffer)) {
+		len = sizeof(buffer) - 1;
+	}
 	VMArray *array = Array_New(c);
-	Array_SetString(array, buffer);
+	Array_SetStringBuffer(array, buffer, len);
 	VM_Push(c, array->handle, 0x10000 | VAR_TYPE_CHAR);
 }
 
-static void op_iftop_eq(VMContext *c) {
+static void op_iftop_eq(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_iftop_eq");
 	VMVar st = VM_Top2(c);
 	if (st.value != 0) {
-		op_jump(c);
-	} else {
-		c->code += 4;
-		c->script->code_offset += 4;
+		op_jump(c, insn);
 	}
 }
 
-static void op_iftop_neq(VMContext *c) {
+static void op_iftop_neq(VMContext *c, VMInsn *insn) {
 	debug(DBG_OPCODES, "op_iftop_neq");
 	VMVar st = VM_Top2(c);
 	if (st.value == 0) {
-		op_jump(c);
-	} else {
-		c->code += 4;
-		c->script->code_offset += 4;
+		op_jump(c, insn);
 	}
 }
 
-static void (*_opcodes[256])(VMContext *);
+static void (*_opcodes[256])(VMContext *, VMInsn *);
 
 void VM_InitOpcodes() {
 	for (int i = 0; i < 256; ++i) {
@@ -1598,13 +1590,375 @@ void VM_InitOpcodes() {
 	_opcodes[0xba] = &op_format_string;
 	_opcodes[0xbc] = &op_iftop_eq;
 	_opcodes[0xbd] = &op_iftop_neq;
+	/* the unchecked opcodes are not decoded from the bytecode */
+	_opcodes[0xc0] = &op_push_local_unchecked;
+	_opcodes[0xc1] = &op_pop_local_unchecked;
+	_opcodes[0xc2] = &op_add_local_int;
+	_opcodes[0xc3] = &op_if_local_int;
 }
 
-void VM_ExecuteOpcode(VMContext *c, int op) {
-	debug(DBG_OPCODES, "VM_ExecuteOpcode op:0x%02x", op);
-	if (_opcodes[op] == &op_nop) {
-		error("Unimplemented opcode 0x%02x", op);
+void VM_ExecuteInsn(VMContext *c, VMInsn *insn) {
+	debug(DBG_OPCODES, "VM_ExecuteInsn op:0x%02x", insn->op);
+	if (_opcodes[insn->op] == &op_nop) {
+		error("Unimplemented opcode 0x%02x", insn->op);
 	} else {
-		(*_opcodes[op])(c);
+		(*_opcodes[insn->op])(c, insn);
+	}
+}
+
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH 1
+#endif
+
+#ifdef NDEBUG
+#define TRACE_OPCODE(op)
+#else
+#define TRACE_OPCODE(op) if (g_debugMask & DBG_OPCODES) debug(DBG_OPCODES, "VM_Execute op:0x%02x", op)
+#endif
+
+#ifdef VM_PROFILE_OPCODES
+/* opcodes n-grams histogram, used to select the fused opcodes */
+#define PROFILE_NGRAMS 4
+#define PROFILE_SIZE   8192
+
+typedef struct {
+	uint64_t key; /* n << 32 | last n opcodes */
+	uint32_t count;
+} ProfileEntry;
+
+static ProfileEntry _profile[PROFILE_SIZE];
+static int _profileCount;
+static uint32_t _profileHistory;
+static int _profileLength;
+static uint64_t _profileDispatches, _profileSaved;
+
+static void profileOpcode(int op) {
+	_profileHistory = (_profileHistory << 8) | op;
+	if (_profileLength < PROFILE_NGRAMS) {
+		++_profileLength;
+	}
+	++_profileDispatches;
+	for (int n = 2; n <= _profileLength; ++n) {
+		const uint32_t ops = (n == 4) ? _profileHistory : (_profileHistory & ((1 << (n * 8)) - 1));
+		const uint64_t key = ((uint64_t)n << 32) | ops;
+		uint32_t i = (key * 0x9E3779B97F4A7C15ULL) >> 51;
+		while (_profile[i].key != key && _profile[i].key != 0) {
+			i = (i + 1) & (PROFILE_SIZE - 1);
+		}
+		if (_profile[i].key == key) {
+			++_profile[i].count;
+		} else if (_profileCount < PROFILE_SIZE * 3 / 4) {
+			_profile[i].key = key;
+			_profile[i].count = 1;
+			++_profileCount;
+		}
+	}
+}
+
+static int compareProfileEntry(const void *a, const void *b) {
+	const ProfileEntry *e1 = (const ProfileEntry *)a;
+	const ProfileEntry *e2 = (const ProfileEntry *)b;
+	if (e1->key >> 32 != e2->key >> 32) {
+		return (e1->key >> 32 < e2->key >> 32) ? -1 : 1;
+	}
+	return (e1->count > e2->count) ? -1 : (e1->count < e2->count);
+}
+
+#define PROFILE_OPCODE(op) profileOpcode(op)
+#define PROFILE_FUSED(n)   _profileSaved += (n)
+#define PROFILE_RESET()    _profileLength = 0
+#else
+#define PROFILE_OPCODE(op)
+#define PROFILE_FUSED(n)
+#define PROFILE_RESET()
+#endif
+
+void VM_DumpOpcodesProfile() {
+#ifdef VM_PROFILE_OPCODES
+	qsort(_profile, PROFILE_SIZE, sizeof(ProfileEntry), compareProfileEntry);
+	int printed = 0;
+	for (int i = 0; i < PROFILE_SIZE; ++i) {
+		const ProfileEntry *e = &_profile[i];
+		if (e->key == 0) {
+			continue;
+		}
+		const int n = e->key >> 32;
+		if (i == 0 || (_profile[i - 1].key >> 32) != n) {
+			printed = 0;
+		}
+		if (printed++ < 16) {
+			char buf[32];
+			int len = 0;
+			for (int j = n - 1; j >= 0; --j) {
+				len += snprintf(buf + len, sizeof(buf) - len, " %02x", (uint32_t)(e->key >> (j * 8)) & 0xFF);
+			}
+			debug(DBG_INFO, "Opcodes%s count %d", buf, e->count);
+		}
+	}
+	const uint64_t total = _profileDispatches + _profileSaved;
+	debug(DBG_INFO, "Dispatches %llu, %llu removed by the fused opcodes (%.1f%%)", (unsigned long long)_profileDispatches, (unsigned long long)_profileSaved, total ? _profileSaved * 100. / total : 0.);
+	memset(_profile, 0, sizeof(_profile));
+	_profileCount = 0;
+#endif
+}
+
+void VM_Execute(VMContext *c, VMScript *script) {
+	VMInsn *code = c->code;
+	VMInsn *insn;
+	VMVar *stack = c->stack;
+	int sp = c->sp;
+	PROFILE_RESET();
+
+#define POP(v) do { if (--sp < 0) { error("Stack underflow"); } v = stack[sp]; } while (0)
+#define PUSH(val, t) do { stack[sp].value = (val); stack[sp].type = (t); if (++sp >= VMSTACK_SIZE) { error("Stack overflow"); } } while (0)
+#define BINOP_INT(expr) do { VMVar b, a; POP(b); POP(a); PUSH(expr, VAR_TYPE_INT32); } while (0)
+#define JUMP() do { \
+		if (!insn->target) { \
+			goto op_generic_call; \
+		} \
+		code = insn->target; \
+	} while (0)
+
+#ifdef VM_THREADED_DISPATCH
+	static const void *dispatch[256];
+	if (!dispatch[0]) {
+		for (int i = 0; i < 256; ++i) {
+			dispatch[i] = &&op_generic;
+		}
+		dispatch[0x02] = &&op_jump;
+		dispatch[0x06] = &&op_push_int8;
+		dispatch[0x07] = &&op_push_int32;
+		dispatch[0x08] = &&op_push_local;
+		dispatch[0x09] = &&op_push_me;
+		dispatch[0x0d] = &&op_pop;
+		dispatch[0x0e] = &&op_pop_local;
+		dispatch[0x18] = &&op_add_int;
+		dispatch[0x19] = &&op_sub_int;
+		dispatch[0x1a] = &&op_mul_int;
+		dispatch[0x28] = &&op_if_eq;
+		dispatch[0x29] = &&op_if_neq;
+		dispatch[0x2a] = &&op_and;
+		dispatch[0x2b] = &&op_or;
+		dispatch[0x2c] = &&op_eq_int;
+		dispatch[0x2d] = &&op_neq_int;
+		dispatch[0x2e] = &&op_leq_int;
+		dispatch[0x2f] = &&op_geq_int;
+		dispatch[0x30] = &&op_lt_int;
+		dispatch[0x31] = &&op_gt_int;
+		dispatch[0x48] = &&op_not_int;
+		dispatch[0x6c] = &&op_dup;
+		dispatch[0xbc] = &&op_iftop_eq;
+		dispatch[0xbd] = &&op_iftop_neq;
+		dispatch[0xc0] = &&op_push_local_unchecked;
+		dispatch[0xc1] = &&op_pop_local_unchecked;
+		dispatch[0xc2] = &&op_add_local_int;
+		dispatch[0xc3] = &&op_if_local_int;
+	}
+#define OPCODE(x, name) name
+#define OPCODE_GENERIC  op_generic
+#define NEXT() do { insn = code; code += insn->len; TRACE_OPCODE(insn->op); PROFILE_OPCODE(insn->op); goto *dispatch[insn->op]; } while (0)
+	NEXT();
+#else
+#define OPCODE(x, name) case x
+#define OPCODE_GENERIC  default
+#define NEXT() continue
+	while (1) {
+		insn = code;
+		code += insn->len;
+		TRACE_OPCODE(insn->op);
+		PROFILE_OPCODE(insn->op);
+		switch (insn->op) {
+#endif
+	OPCODE(0x02, op_jump):
+		JUMP();
+		NEXT();
+	OPCODE(0x06, op_push_int8): {
+			PUSH(insn->num, VAR_TYPE_INT32);
+		}
+		NEXT();
+	OPCODE(0x07, op_push_int32): {
+			PUSH(insn->num, VAR_TYPE_INT32);
+		}
+		NEXT();
+	OPCODE(0x08, op_push_local): {
+			const uint32_t num = insn->num;
+			if (num & 0xFFFF0000) {
+				goto op_generic_call;
+			}
+			if (num > script->local_vars_count) {
+				error("Local variable %d out of range (%d..%d)", num, 0, script->local_vars_count);
+			}
+			const VMVar *var = &script->local_vars[num];
+			PUSH(var->value, var->type);
+		}
+		NEXT();
+	OPCODE(0x09, op_push_me): {
+			const VMObject *obj = script->obj;
+			const VMMemberCache *cache = insn->member;
+			if (!obj || insn->count != 1 || cache->count == 0 || cache->class_handle[0] != obj->class_handle) {
+				goto op_generic_call;
+			}
+			const VMVar *var = &obj->members[cache->data_index[0]];
+			PUSH(var->value, var->type);
+		}
+		NEXT();
+	OPCODE(0x0d, op_pop):
+		if (--sp < 0) {
+			error("Stack underflow");
+		}
+		NEXT();
+	OPCODE(0x0e, op_pop_local): {
+			const uint32_t num = insn->num;
+			if (num & 0xFFFF0000) {
+				goto op_generic_call;
+			}
+			if (num > script->local_vars_count) {
+				error("Local variable %d out of range (%d..%d)", num, 0, script->local_vars_count);
+			}
+			VMVar *var = &script->local_vars[num];
+			VM_CheckVarType(var->type);
+			VMVar st;
+			POP(st);
+			VM_CheckVarType(st.type);
+			var->value = VM_ConvertVar(var->type, &st);
+		}
+		NEXT();
+	OPCODE(0x18, op_add_int):
+		BINOP_INT(a.value + b.value);
+		NEXT();
+	OPCODE(0x19, op_sub_int):
+		BINOP_INT(a.value - b.value);
+		NEXT();
+	OPCODE(0x1a, op_mul_int):
+		BINOP_INT(a.value * b.value);
+		NEXT();
+	OPCODE(0x28, op_if_eq): {
+			VMVar st;
+			POP(st);
+			if (st.value != 0) {
+				JUMP();
+			}
+		}
+		NEXT();
+	OPCODE(0x29, op_if_neq): {
+			VMVar st;
+			POP(st);
+			if (st.value == 0) {
+				JUMP();
+			}
+		}
+		NEXT();
+	OPCODE(0x2a, op_and):
+		BINOP_INT(a.value != 0 && b.value != 0);
+		NEXT();
+	OPCODE(0x2b, op_or):
+		BINOP_INT(a.value != 0 || b.value != 0);
+		NEXT();
+	OPCODE(0x2c, op_eq_int):
+		BINOP_INT(a.value == b.value);
+		NEXT();
+	OPCODE(0x2d, op_neq_int):
+		BINOP_INT(a.value != b.value);
+		NEXT();
+	OPCODE(0x2e, op_leq_int):
+		BINOP_INT(a.value <= b.value);
+		NEXT();
+	OPCODE(0x2f, op_geq_int):
+		BINOP_INT(a.value >= b.value);
+		NEXT();
+	OPCODE(0x30, op_lt_int):
+		BINOP_INT(a.value < b.value);
+		NEXT();
+	OPCODE(0x31, op_gt_int):
+		BINOP_INT(a.value > b.value);
+		NEXT();
+	OPCODE(0x48, op_not_int): {
+			VMVar st;
+			POP(st);
+			PUSH(st.value == 0, VAR_TYPE_INT32);
+		}
+		NEXT();
+	OPCODE(0x6c, op_dup): {
+			if (sp < 1) {
+				error("Stack underflow");
+			}
+			const VMVar st = stack[sp - 1];
+			PUSH(st.value, st.type);
+		}
+		NEXT();
+	OPCODE(0xbc, op_iftop_eq):
+		if (sp < 1) {
+			error("Stack underflow");
+		}
+		if (stack[sp - 1].value != 0) {
+			JUMP();
+		}
+		NEXT();
+	OPCODE(0xbd, op_iftop_neq):
+		if (sp < 1) {
+			error("Stack underflow");
+		}
+		if (stack[sp - 1].value == 0) {
+			JUMP();
+		}
+		NEXT();
+	OPCODE(0xc0, op_push_local_unchecked): {
+			const VMVar *var = &script->local_vars[insn->num];
+			PUSH(var->value, var->type);
+		}
+		NEXT();
+	OPCODE(0xc1, op_pop_local_unchecked):
+		--sp;
+		script->local_vars[insn->num].value = stack[sp].value;
+		NEXT();
+	OPCODE(0xc2, op_add_local_int): {
+			const VMInsn *last = insn->target;
+			VMVar *locals = script->local_vars;
+			const int value = (insn + insn->len)->num;
+			locals[last->num].value = (insn->type == 0x18) ? locals[insn->num].value + value : locals[insn->num].value - value;
+			code = (VMInsn *)last + last->len;
+			PROFILE_FUSED(3);
+		}
+		NEXT();
+	OPCODE(0xc3, op_if_local_int): {
+			const VMInsn *last = insn->target;
+			const int res = compareInt(insn->type, script->local_vars[insn->num].value, (insn + insn->len)->num);
+			code = ((res != 0) == (last->op == 0x28)) ? last->target : (VMInsn *)last + last->len;
+			PROFILE_FUSED(3);
+		}
+		NEXT();
+	OPCODE_GENERIC:
+op_generic_call:
+		if (_opcodes[insn->op] == &op_nop) {
+			error("Unimplemented opcode 0x%02x", insn->op);
+		}
+		/* out of line opcodes work on the context, the offset is synced back in executeMethod */
+		c->code = code;
+		c->sp = sp;
+		(*_opcodes[insn->op])(c, insn);
+		code = c->code;
+		sp = c->sp;
+		if (script->state != 0) {
+			goto done;
+		}
+		if (script->thread->state != SCRIPT_STATE_RUNNING) {
+			script->state = script->thread->state;
+			goto done;
+		}
+		NEXT();
+#ifndef VM_THREADED_DISPATCH
+		}
 	}
+#endif
+done:
+	c->code = code;
+	c->sp = sp;
+
+#undef POP
+#undef PUSH
+#undef BINOP_INT
+#undef JUMP
+#undef OPCODE
+#undef OPCODE_GENERIC
+#undef NEXT
 }
@@ -0,0 +1,636 @@
+#include <sys/param.h>
+#include "pan.h"
+#include "util.h"
+#include "vm.h"
+
+/* offline pass over the classes bytecode, the rewritten classes are loaded
+ * with --sob-path. The instructions reachable from the methods entries are
+ * decoded in a list kept in the bytecode order, the removed instructions
+ * forward the jumps to the next one. A class with an unknown opcode or a
+ * jump in the middle of an instruction is written unchanged. */
+
+#define OPT_PASSES 16
+
+typedef struct {
+	uint32_t offset; /* in the original bytecode */
+	uint8_t op, size, type;
+	uint8_t removed;
+	int32_t num;
+	int target; /* instruction index, -1 if none */
+} OptInsn;
+
+typedef struct {
+	SobData *sob;
+	int gameID;
+	OptInsn *insns;
+	int count;
+	int *index; /* instruction index by offset, -1 if none */
+	uint8_t *incoming; /* method entry or jump target */
+	uint8_t *reached;
+	uint8_t *live; /* op_pop_local with the local read in the method */
+	uint8_t *used;
+	int *stack;
+	uint8_t reads[65536 / 8]; /* locals read in the method */
+} Optimizer;
+
+static bool isJump(int op) {
+	switch (op) {
+	case 0x02: /* op_jump */
+	case 0x28: /* op_if_eq */
+	case 0x29: /* op_if_neq */
+	case 0xb0: /* op_gotodefine */
+	case 0xbc: /* op_iftop_eq */
+	case 0xbd: /* op_iftop_neq */
+		return true;
+	}
+	return false;
+}
+
+static bool fallsThrough(int op) {
+	switch (op) {
+	case 0x02: /* op_jump */
+	case 0x04: /* op_return */
+	case 0x05:
+	case 0x41: /* op_quit */
+		return false;
+	}
+	return true;
+}
+
+static bool isPushInt(const OptInsn *insn) {
+	return insn->op == 0x06 || insn->op == 0x07;
+}
+
+static bool isLocalEntry(const SobData *sob, const SobCodeEntry *code) {
+	return code->locals_offset != -1 && code->code_offset < sob->code_size;
+}
+
+static int getLocalsCount(const OptInsn *insn) {
+	return (insn->num & 0xFFFF0000) ? ((insn->num >> 16) & 0xFF) : 1;
+}
+
+/* marks the instructions start offsets, returns false if the bytecode can not be rewritten */
+static bool markInsns(Optimizer *o, uint8_t *starts) {
+	SobData *sob = o->sob;
+	uint8_t *inside = (uint8_t *)calloc(sob->code_size, 1);
+	int *offsets = (int *)malloc(sob->code_size * sizeof(int));
+	if (!inside || !offsets) {
+		error("Failed to allocate optimizer for class '%s'", sob->class_name);
+	}
+	bool ret = true;
+	int count = 0;
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		const SobCodeEntry *code = &sob->codeentries_data[i];
+		if (isLocalEntry(sob, code) && !starts[code->code_offset]) {
+			starts[code->code_offset] = 1;
+			offsets[count++] = code->code_offset;
+		}
+	}
+	while (ret && count != 0) {
+		int offset = offsets[--count];
+		while (1) {
+			const uint8_t *p = sob->code_data + offset;
+			const int size = Insn_GetSize(p[0], o->gameID);
+			if (size == 0 || offset + size > sob->code_size || inside[offset]) {
+				ret = false;
+				break;
+			}
+			for (int i = 1; i < size; ++i) {
+				if (starts[offset + i]) {
+					ret = false;
+					break;
+				}
+				inside[offset + i] = 1;
+			}
+			if (isJump(p[0]) && size == 5 && (p[0] != 0xb0 || READ_LE_UINT32(p + 1) != 0)) {
+				const int target = offset + (int32_t)READ_LE_UINT32(p + 1);
+				if (target < 0 || target >= sob->code_size || inside[target]) {
+					ret = false;
+					break;
+				}
+				if (!starts[target]) {
+					starts[target] = 1;
+					offsets[count++] = target;
+				}
+			}
+			if (!fallsThrough(p[0])) {
+				break;
+			}
+			offset += size;
+			if (offset >= sob->code_size || inside[offset]) {
+				ret = false;
+				break;
+			}
+			if (starts[offset]) {
+				break;
+			}
+			starts[offset] = 1;
+		}
+	}
+	free(offsets);
+	free(inside);
+	return ret;
+}
+
+static bool decodeSob(Optimizer *o) {
+	SobData *sob = o->sob;
+	uint8_t *starts = (uint8_t *)calloc(sob->code_size, 1);
+	o->index = (int *)malloc(sob->code_size * sizeof(int));
+	if (!starts || !o->index) {
+		error("Failed to allocate optimizer for class '%s'", sob->class_name);
+	}
+	if (!markInsns(o, starts)) {
+		free(starts);
+		return false;
+	}
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		o->index[offset] = -1;
+		o->count += starts[offset];
+	}
+	o->insns = (OptInsn *)calloc(o->count + 1, sizeof(OptInsn));
+	o->incoming = (uint8_t *)malloc((o->count + 1) * 4);
+	o->stack = (int *)malloc((o->count + 1) * sizeof(int));
+	if (!o->insns || !o->incoming || !o->stack) {
+		error("Failed to allocate %d instructions for class '%s'", o->count, sob->class_name);
+	}
+	o->reached = o->incoming + o->count;
+	o->live = o->reached + o->count;
+	o->used = o->live + o->count;
+	int num = 0;
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		if (!starts[offset]) {
+			continue;
+		}
+		OptInsn *insn = &o->insns[num];
+		o->index[offset] = num++;
+		const uint8_t *p = sob->code_data + offset;
+		insn->offset = offset;
+		insn->op = p[0];
+		insn->size = Insn_GetSize(p[0], o->gameID);
+		insn->target = -1;
+		switch (insn->size) {
+		case 2:
+			insn->num = p[1];
+			break;
+		case 5:
+			insn->num = READ_LE_UINT32(p + 1);
+			break;
+		case 6:
+			insn->type = p[1];
+			insn->num = READ_LE_UINT32(p + 2);
+			break;
+		}
+	}
+	for (int i = 0; i < o->count; ++i) {
+		OptInsn *insn = &o->insns[i];
+		if (isJump(insn->op) && insn->size == 5 && (insn->op != 0xb0 || insn->num != 0)) {
+			insn->target = o->index[insn->offset + insn->num];
+		}
+	}
+	free(starts);
+	return true;
+}
+
+static int nextInsn(Optimizer *o, int i) {
+	while (++i < o->count) {
+		if (!o->insns[i].removed) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int prevInsn(Optimizer *o, int i) {
+	while (--i >= 0) {
+		if (!o->insns[i].removed) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* the jumps to a removed instruction continue with the next one */
+static int resolveInsn(Optimizer *o, int i) {
+	return (i == -1 || !o->insns[i].removed) ? i : nextInsn(o, i);
+}
+
+static int getSuccessors(Optimizer *o, int i, int *next) {
+	const OptInsn *insn = &o->insns[i];
+	int count = 0;
+	if (insn->target != -1) {
+		next[count++] = resolveInsn(o, insn->target);
+	}
+	if (fallsThrough(insn->op)) {
+		next[count++] = nextInsn(o, i);
+	}
+	return count;
+}
+
+static int resolveEntry(Optimizer *o, uint32_t offset) {
+	return resolveInsn(o, o->index[offset]);
+}
+
+/* walks the instructions of the method, the visited ones are returned in o->stack */
+static int walkMethod(Optimizer *o, int entry) {
+	memset(o->reached, 0, o->count);
+	int top = 0;
+	o->reached[entry] = 1;
+	o->stack[top++] = entry;
+	while (top != 0) {
+		int next[2];
+		const int next_count = getSuccessors(o, o->stack[--top], next);
+		for (int j = 0; j < next_count; ++j) {
+			if (next[j] != -1 && !o->reached[next[j]]) {
+				o->reached[next[j]] = 1;
+				o->stack[top++] = next[j];
+			}
+		}
+	}
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		if (o->reached[i]) {
+			o->stack[count++] = i;
+		}
+	}
+	return count;
+}
+
+static void updateIncoming(Optimizer *o) {
+	memset(o->incoming, 0, o->count);
+	const SobData *sob = o->sob;
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		const SobCodeEntry *code = &sob->codeentries_data[i];
+		if (isLocalEntry(sob, code)) {
+			o->incoming[resolveEntry(o, code->code_offset)] = 1;
+		}
+	}
+	for (int i = 0; i < o->count; ++i) {
+		const OptInsn *insn = &o->insns[i];
+		if (!insn->removed && insn->target != -1) {
+			o->incoming[resolveInsn(o, insn->target)] = 1;
+		}
+	}
+}
+
+/* op_jump to op_jump chains */
+static int threadJumps(Optimizer *o) {
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		OptInsn *insn = &o->insns[i];
+		if (insn->removed || insn->target == -1) {
+			continue;
+		}
+		int target = resolveInsn(o, insn->target);
+		for (int hops = 0; hops < o->count && target != -1 && o->insns[target].op == 0x02 && target != i; ++hops) {
+			target = resolveInsn(o, o->insns[target].target);
+		}
+		if (target == -1 || o->insns[target].op == 0x02) {
+			continue; /* loop */
+		}
+		if (target != resolveInsn(o, insn->target)) {
+			insn->target = target;
+			++count;
+		}
+	}
+	return count;
+}
+
+static void setPushInt(OptInsn *insn, int value) {
+	insn->op = (value >= 0 && value <= 255) ? 0x06 : 0x07;
+	insn->size = (insn->op == 0x06) ? 2 : 5;
+	insn->num = value;
+}
+
+static bool foldInt(int op, int a, int b, int *value) {
+	switch (op) {
+	case 0x18: /* op_add_int */
+		*value = (int)((uint32_t)a + (uint32_t)b);
+		break;
+	case 0x19: /* op_sub_int */
+		*value = (int)((uint32_t)a - (uint32_t)b);
+		break;
+	case 0x1a: /* op_mul_int */
+		*value = (int)((uint32_t)a * (uint32_t)b);
+		break;
+	case 0x2a: /* op_and */
+		*value = a != 0 && b != 0;
+		break;
+	case 0x2b: /* op_or */
+		*value = a != 0 || b != 0;
+		break;
+	case 0x2c: /* op_eq_int */
+		*value = a == b;
+		break;
+	case 0x2d: /* op_neq_int */
+		*value = a != b;
+		break;
+	case 0x2e: /* op_leq_int */
+		*value = a <= b;
+		break;
+	case 0x2f: /* op_geq_int */
+		*value = a >= b;
+		break;
+	case 0x30: /* op_lt_int */
+		*value = a < b;
+		break;
+	case 0x31: /* op_gt_int */
+		*value = a > b;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/* the instructions following the first one of a sequence must not be jump targets */
+static int foldConstants(Optimizer *o) {
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		OptInsn *insn = &o->insns[i];
+		if (insn->removed || !isPushInt(insn)) {
+			continue;
+		}
+		const int i2 = nextInsn(o, i);
+		if (i2 == -1 || o->incoming[i2]) {
+			continue;
+		}
+		OptInsn *insn2 = &o->insns[i2];
+		int value;
+		if (insn2->op == 0x48) { /* op_not_int */
+			setPushInt(insn, insn->num == 0);
+			insn2->removed = 1;
+			++count;
+			continue;
+		}
+		if (isPushInt(insn2)) {
+			const int i3 = nextInsn(o, i2);
+			if (i3 == -1 || o->incoming[i3]) {
+				continue;
+			}
+			OptInsn *insn3 = &o->insns[i3];
+			if (foldInt(insn3->op, insn->num, insn2->num, &value)) {
+				setPushInt(insn, value);
+				insn2->removed = 1;
+				insn3->removed = 1;
+				++count;
+			}
+		} else if (insn2->op == 0x28 || insn2->op == 0x29) { /* op_if_eq, op_if_neq */
+			const bool taken = (insn2->op == 0x28) ? (insn->num != 0) : (insn->num == 0);
+			if (taken) {
+				insn->op = 0x02; /* op_jump */
+				insn->size = 5;
+				insn->target = insn2->target;
+			} else {
+				insn->removed = 1;
+			}
+			insn2->removed = 1;
+			++count;
+		}
+	}
+	return count;
+}
+
+static int removePeepholes(Optimizer *o) {
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		OptInsn *insn = &o->insns[i];
+		if (insn->removed) {
+			continue;
+		}
+		const int i2 = nextInsn(o, i);
+		if (i2 == -1) {
+			continue;
+		}
+		OptInsn *insn2 = &o->insns[i2];
+		if (insn->target != -1 && resolveInsn(o, insn->target) == i2 && insn->op != 0xb0) {
+			/* jump to the next instruction */
+			if (insn->op == 0x28 || insn->op == 0x29) {
+				insn->op = 0x0d; /* op_pop */
+				insn->size = 1;
+				insn->target = -1;
+			} else {
+				insn->removed = 1;
+			}
+			++count;
+		} else if ((insn->op == 0x6c || isPushInt(insn)) && insn2->op == 0x0d && !o->incoming[i2]) {
+			/* op_dup or op_push_int followed by op_pop */
+			insn->removed = 1;
+			insn2->removed = 1;
+			++count;
+		}
+	}
+	return count;
+}
+
+static void setReadLocals(Optimizer *o, const OptInsn *insn) {
+	int count = 1;
+	switch (insn->op) {
+	case 0x08: /* op_push_local */
+		count = getLocalsCount(insn);
+		break;
+	case 0x32: /* op_push_local_array */
+	case 0x37: /* op_pop_local_array */
+	case 0xb8: /* op_push_raw_local_array */
+		break;
+	default:
+		return;
+	}
+	for (int num = insn->num & 0xFFFF; count != 0 && num < 65536; ++num, --count) {
+		o->reads[num >> 3] |= 1 << (num & 7);
+	}
+}
+
+static bool isIntResult(const OptInsn *insn) {
+	int value;
+	return isPushInt(insn) || insn->op == 0x48 || foldInt(insn->op, 0, 0, &value);
+}
+
+/* stores of an integer to a local never read in the methods reaching the
+ * store. The stores of handles are kept, the local holds the reference for
+ * the garbage collector. */
+static int removeDeadStores(Optimizer *o) {
+	const SobData *sob = o->sob;
+	memset(o->live, 0, o->count);
+	for (int e = 1; e <= sob->codeentries_count; ++e) {
+		const SobCodeEntry *code = &sob->codeentries_data[e];
+		if (!isLocalEntry(sob, code)) {
+			continue;
+		}
+		const int count = walkMethod(o, resolveEntry(o, code->code_offset));
+		memset(o->reads, 0, sizeof(o->reads));
+		for (int i = 0; i < count; ++i) {
+			setReadLocals(o, &o->insns[o->stack[i]]);
+		}
+		for (int i = 0; i < count; ++i) {
+			const OptInsn *store = &o->insns[o->stack[i]];
+			if (store->op == 0x0e && (store->num & 0xFFFF0000) == 0 && (o->reads[store->num >> 3] & (1 << (store->num & 7))) != 0) {
+				o->live[o->stack[i]] = 1;
+			}
+		}
+	}
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		OptInsn *insn = &o->insns[i];
+		if (insn->removed || insn->op != 0x0e || (insn->num & 0xFFFF0000) != 0 || o->live[i] || o->incoming[i]) {
+			continue;
+		}
+		const int prev = prevInsn(o, i);
+		if (prev == -1 || !isIntResult(&o->insns[prev])) {
+			continue;
+		}
+		insn->op = 0x0d; /* op_pop */
+		insn->size = 1;
+		++count;
+	}
+	return count;
+}
+
+static int removeUnreachable(Optimizer *o) {
+	const SobData *sob = o->sob;
+	uint8_t *used = o->used;
+	memset(used, 0, o->count);
+	for (int e = 1; e <= sob->codeentries_count; ++e) {
+		const SobCodeEntry *code = &sob->codeentries_data[e];
+		if (isLocalEntry(sob, code)) {
+			const int count = walkMethod(o, resolveEntry(o, code->code_offset));
+			for (int i = 0; i < count; ++i) {
+				used[o->stack[i]] = 1;
+			}
+		}
+	}
+	int count = 0;
+	for (int i = 0; i < o->count; ++i) {
+		if (!o->insns[i].removed && !used[i]) {
+			o->insns[i].removed = 1;
+			++count;
+		}
+	}
+	return count;
+}
+
+static void writeCode(Optimizer *o) {
+	SobData *sob = o->sob;
+	int *offsets = (int *)malloc(o->count * sizeof(int));
+	if (!offsets) {
+		error("Failed to allocate %d instructions for class '%s'", o->count, sob->class_name);
+	}
+	int size = 0;
+	for (int i = 0; i < o->count; ++i) {
+		offsets[i] = size;
+		if (!o->insns[i].removed) {
+			size += o->insns[i].size;
+		}
+	}
+	uint8_t *code = (uint8_t *)malloc(size);
+	if (!code && size != 0) {
+		error("Failed to allocate %d bytes for class '%s'", size, sob->class_name);
+	}
+	for (int i = 0; i < o->count; ++i) {
+		const OptInsn *insn = &o->insns[i];
+		if (insn->removed) {
+			continue;
+		}
+		uint8_t *p = code + offsets[i];
+		p[0] = insn->op;
+		const int num = (insn->target != -1) ? offsets[resolveInsn(o, insn->target)] - offsets[i] : insn->num;
+		switch (insn->size) {
+		case 2:
+			p[1] = num;
+			break;
+		case 5:
+			WRITE_LE_UINT32(p + 1, num);
+			break;
+		case 6:
+			p[1] = insn->type;
+			WRITE_LE_UINT32(p + 2, num);
+			break;
+		}
+	}
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		SobCodeEntry *entry = &sob->codeentries_data[i];
+		if (isLocalEntry(sob, entry)) {
+			entry->code_offset = offsets[resolveEntry(o, entry->code_offset)];
+		} else if (entry->locals_offset != -1) {
+			entry->code_offset = size + entry->code_offset - sob->code_size; /* still out of range */
+		}
+	}
+	free(sob->code_data);
+	sob->code_data = code;
+	sob->code_size = size;
+	free(offsets);
+}
+
+/* returns the count of instructions before and after */
+static void optimizeSob(SobData *sob, int gameID, int *before, int *after) {
+	Optimizer o;
+	memset(&o, 0, sizeof(o));
+	o.sob = sob;
+	o.gameID = gameID;
+	if (!decodeSob(&o)) {
+		warning("Class '%s' bytecode not optimised", sob->class_name);
+		*before = *after = 0;
+	} else {
+		*before = o.count;
+		for (int pass = 0; pass < OPT_PASSES; ++pass) {
+			int count = 0;
+			updateIncoming(&o);
+			count += threadJumps(&o);
+			updateIncoming(&o);
+			count += foldConstants(&o);
+			updateIncoming(&o);
+			count += removePeepholes(&o);
+			updateIncoming(&o);
+			count += removeDeadStores(&o);
+			count += removeUnreachable(&o);
+			if (count == 0) {
+				break;
+			}
+		}
+		*after = 0;
+		for (int i = 0; i < o.count; ++i) {
+			*after += !o.insns[i].removed;
+		}
+		writeCode(&o);
+	}
+	free(o.stack);
+	free(o.incoming);
+	free(o.insns);
+	free(o.index);
+}
+
+/* rewrites the classes of the game data to the directory, loaded with Pan_SetOverridePath */
+void VM_WriteOptimizedClasses(VMContext *c, const char *path) {
+	int before_total = 0, after_total = 0;
+	for (int i = 0; i < Pan_GetAssetsCount(); ++i) {
+		const PanAsset *asset = Pan_GetAsset(i);
+		if (asset->type != PAN_ASSET_TYPE_SOB || !asset->name) {
+			continue;
+		}
+		PanBuffer pb;
+		if (!Pan_LoadAssetByName(asset->name, &pb)) {
+			continue;
+		}
+		char filename[MAXPATHLEN];
+		snprintf(filename, sizeof(filename), "%s/%s", path, asset->name);
+		FILE *fp = fopen(filename, "wb");
+		if (!fp) {
+			error("Unable to open '%s' for writing", filename);
+		}
+		for (int offset = 0; offset < pb.size; ) {
+			SobData *sob = LoadSob(pb.buffer, pb.size, &offset, asset->name);
+			sob->class_name = Sob_GetString(sob, Sob_GetRefClass(sob, 1)->name_index);
+			int before, after;
+			optimizeSob(sob, c->gameID, &before, &after);
+			if (before != 0) {
+				debug(DBG_INFO, "Class '%s' instructions %d -> %d (%.1f%%)", sob->class_name, before, after, (before - after) * 100. / before);
+				before_total += before;
+				after_total += after;
+			}
+			Sob_Write(sob, fp);
+			UnloadSob(sob);
+		}
+		fclose(fp);
+		Pan_UnloadAsset(&pb);
+	}
+	debug(DBG_INFO, "Instructions %d -> %d (%.1f%%) written to '%s'", before_total, after_total, before_total ? (before_total - after_total) * 100. / before_total : 0., path);
+}
@@ -2,27 +2,84 @@
 #include "util.h"
 #include "vm.h"
 
+/* fewer slots than the objects and arrays pools, the handles have more generations */
+#define THREAD_INDEX_BITS  12
+#define THREAD_INDEX_MASK  ((1 << THREAD_INDEX_BITS) - 1)
+#define THREAD_GENERATIONS ((BASE_HANDLE_FILE - BASE_HANDLE_THREAD) >> THREAD_INDEX_BITS)
+
+static void freeThreadSlot(VMContext *c, int num) {
+	VM_GetThreadSlot(c, num)->next_free = 0;
+	if (c->threads_free_tail != 0) {
+		VM_GetThreadSlot(c, c->threads_free_tail)->next_free = num;
+	} else {
+		c->threads_next_free = num;
+	}
+	c->threads_free_tail = num;
+}
+
+static void growThreads(VMContext *c) {
+	const int num = c->threads_capacity;
+	VMThread *chunk = (VMThread *)calloc(VMPOOL_CHUNK_SIZE, sizeof(VMThread));
+	VMScript *scripts = (VMScript *)calloc(VMPOOL_CHUNK_SIZE, sizeof(VMScript));
+	if (!chunk || !scripts) {
+		error("Failed to allocate %d threads", VMPOOL_CHUNK_SIZE);
+	}
+	c->threads[num / VMPOOL_CHUNK_SIZE] = chunk;
+	c->scripts[num / VMPOOL_CHUNK_SIZE] = scripts;
+	c->threads_capacity = num + VMPOOL_CHUNK_SIZE;
+	for (int i = (num == 0) ? 1 : 0; i < VMPOOL_CHUNK_SIZE; ++i) { /* slot 0 is the null handle */
+		freeThreadSlot(c, num + i);
+	}
+	debug(DBG_VM, "Threads pool capacity %d", c->threads_capacity);
+}
+
 VMThread *Thread_New(VMContext *c) {
-	assert(c->threads_next_free != 0);
+	while (c->threads_capacity - 1 - c->scripts_count < VMPOOL_MIN_FREE && c->threads_capacity < (1 << THREAD_INDEX_BITS)) {
+		growThreads(c);
+	}
+	if (c->threads_next_free == 0) {
+		error("Too many threads allocated (%d)", c->scripts_count);
+	}
 	const int num = c->threads_next_free;
-	VMThread *thread = &c->threads[num];
+	VMThread *thread = VM_GetThreadSlot(c, num);
 	c->threads_next_free = thread->next_free;
+	if (c->threads_next_free == 0) {
+		c->threads_free_tail = 0;
+	}
+	const int generation = thread->generation;
 	memset(thread, 0, sizeof(VMThread));
-	++c->thread_handle_counter;
-	if (c->thread_handle_counter > BASE_HANDLE_THREAD + 1999999) {
-		error("Thread handle %d overflow", c->thread_handle_counter);
+	thread->generation = generation;
+	thread->handle = thread->id = BASE_HANDLE_THREAD + ((generation << THREAD_INDEX_BITS) | num);
+	/* the thread root script is recycled with its locals buffer */
+	VMScript *script = &c->scripts[num / VMPOOL_CHUNK_SIZE][num % VMPOOL_CHUNK_SIZE];
+	VMVar *local_vars = script->local_vars;
+	const int locals_capacity = script->locals_capacity;
+	memset(script, 0, sizeof(VMScript));
+	script->local_vars = local_vars;
+	script->locals_capacity = locals_capacity;
+	thread->script = script;
+	++c->scripts_count;
+	if (c->scripts_count > c->scripts_peak) {
+		c->scripts_peak = c->scripts_count;
 	}
-	thread->handle = thread->id = c->thread_handle_counter;
 	return thread;
 }
 
 void Thread_Delete(VMContext *c, VMThread *thread) {
 	VMScript *script = thread->script;
 	if (script) {
-		/* todo */
+		if (script->locals_capacity > VMLOCALS_POOLSIZE) {
+			free(script->local_vars);
+			script->local_vars = 0;
+			script->locals_capacity = 0;
+		}
+		script->next_script = 0;
+		thread->script = 0;
+		--c->scripts_count;
+		debug(DBG_VM, "Thread_Delete handle:%d scripts live:%d peak:%d", thread->handle, c->scripts_count, c->scripts_peak);
 	}
-	thread->next_free = c->threads_next_free;
-	c->threads_next_free = thread - c->threads;
+	thread->generation = (thread->generation + 1) % THREAD_GENERATIONS;
+	freeThreadSlot(c, (thread->handle - BASE_HANDLE_THREAD) & THREAD_INDEX_MASK);
 }
 
 void Thread_Start(VMThread *thread) {
@@ -0,0 +1,308 @@
+#include "util.h"
+#include "vm.h"
+
+/* abstract interpretation of the stack of each method, run once after the
+ * decoding. The instructions proven safe in the methods that pass are
+ * replaced with their unchecked variants, the others keep the checked
+ * opcodes and their error messages. */
+
+#define VERIFY_TYPES 4
+
+typedef struct {
+	int method; /* code entry number, 0 if not visited */
+	int depth; /* entries pushed since the method start or the last unknown opcode */
+	uint8_t unknown; /* the stack below 'depth' entries is unknown */
+	uint8_t queued;
+	int types[VERIFY_TYPES]; /* types of the top entries, 0 if unknown */
+} StackState;
+
+typedef struct {
+	int gameID;
+	SobData *sob;
+	StackState *states;
+	uint8_t *shared; /* reached from several methods */
+	uint32_t *offsets;
+	int count;
+	const SobVar *locals;
+	int locals_count;
+} Verifier;
+
+static bool isVarType(int type) {
+	type &= 0xFF;
+	return type == 12 || (type > 0 && type < 11);
+}
+
+static void pushType(StackState *s, int type) {
+	memmove(s->types + 1, s->types, (VERIFY_TYPES - 1) * sizeof(int));
+	s->types[0] = type;
+	++s->depth;
+}
+
+static bool popType(StackState *s) {
+	if (s->depth == 0) {
+		return s->unknown; /* underflow if the whole stack is known */
+	}
+	memmove(s->types, s->types + 1, (VERIFY_TYPES - 1) * sizeof(int));
+	s->types[VERIFY_TYPES - 1] = 0;
+	--s->depth;
+	return true;
+}
+
+static void resetTypes(StackState *s) {
+	memset(s->types, 0, sizeof(s->types));
+	s->depth = 0;
+	s->unknown = 1;
+}
+
+static bool mergeState(Verifier *v, int method, uint32_t offset, const StackState *s) {
+	if (offset >= v->sob->code_size || v->sob->insns[offset].len == 0) {
+		return false;
+	}
+	StackState *dst = &v->states[offset];
+	if (dst->method != method) {
+		if (dst->method != 0) {
+			v->shared[offset] = 1;
+		}
+		*dst = *s;
+		dst->method = method;
+		dst->queued = 0;
+	} else {
+		if (dst->depth != s->depth && !dst->unknown && !s->unknown) {
+			return false;
+		}
+		StackState merged = *dst;
+		merged.unknown |= s->unknown | (dst->depth != s->depth);
+		if (s->depth < merged.depth) {
+			merged.depth = s->depth;
+		}
+		for (int i = 0; i < VERIFY_TYPES; ++i) {
+			if (i >= merged.depth || dst->types[i] != s->types[i]) {
+				merged.types[i] = 0;
+			}
+		}
+		merged.queued = dst->queued;
+		if (memcmp(&merged, dst, sizeof(StackState)) == 0) {
+			return true;
+		}
+		*dst = merged;
+	}
+	if (!dst->queued) {
+		dst->queued = 1;
+		v->offsets[v->count++] = offset;
+	}
+	return true;
+}
+
+static bool checkLocals(Verifier *v, const VMInsn *insn) {
+	const int num = insn->num & 0xFFFF;
+	return num + insn->count <= v->locals_count;
+}
+
+static bool verifyInsn(Verifier *v, int method, uint32_t offset) {
+	const VMInsn *insn = &v->sob->insns[offset];
+	v->states[offset].queued = 0;
+	StackState s = v->states[offset];
+	switch (insn->op) {
+	case 0x01: /* op_breakhere */
+		resetTypes(&s);
+		break;
+	case 0x02: /* op_jump */
+		return insn->target && mergeState(v, method, insn->target - v->sob->insns, &s);
+	case 0x04: /* op_return */
+	case 0x05:
+	case 0x41: /* op_quit */
+		return true;
+	case 0x06: /* op_push_int8 */
+	case 0x07: /* op_push_int32 */
+		pushType(&s, VAR_TYPE_INT32);
+		break;
+	case 0x08: /* op_push_local */
+		if (!checkLocals(v, insn)) {
+			return false;
+		}
+		for (int i = 0; i < insn->count; ++i) {
+			pushType(&s, v->locals[(insn->num & 0xFFFF) + i].type);
+		}
+		break;
+	case 0x0e: /* op_pop_local */
+		if (!checkLocals(v, insn)) {
+			return false;
+		}
+		for (int i = 0; i < insn->count; ++i) {
+			if (!popType(&s)) {
+				return false;
+			}
+		}
+		break;
+	case 0x09: /* op_push_me */
+		for (int i = 0; i < insn->count; ++i) {
+			pushType(&s, 0);
+		}
+		break;
+	case 0x0f: /* op_pop_me */
+		for (int i = 0; i < insn->count; ++i) {
+			if (!popType(&s)) {
+				return false;
+			}
+		}
+		break;
+	case 0x0d: /* op_pop */
+		if (!popType(&s)) {
+			return false;
+		}
+		break;
+	case 0x18: /* op_add_int */
+	case 0x19: /* op_sub_int */
+	case 0x1a: /* op_mul_int */
+	case 0x1b: /* op_div_int */
+	case 0x2a: /* op_and */
+	case 0x2b: /* op_or */
+	case 0x2c: /* op_eq_int */
+	case 0x2d: /* op_neq_int */
+	case 0x2e: /* op_leq_int */
+	case 0x2f: /* op_geq_int */
+	case 0x30: /* op_lt_int */
+	case 0x31: /* op_gt_int */
+	case 0x45: /* op_mod */
+	case 0x6d: /* op_streq */
+		if (!popType(&s) || !popType(&s)) {
+			return false;
+		}
+		pushType(&s, VAR_TYPE_INT32);
+		break;
+	case 0x48: /* op_not_int */
+		if (!popType(&s)) {
+			return false;
+		}
+		pushType(&s, VAR_TYPE_INT32);
+		break;
+	case 0x3c: /* op_push_string */
+		pushType(&s, 0x10000 | VAR_TYPE_CHAR);
+		break;
+	case 0x6c: /* op_dup */
+		if (s.depth == 0 && !s.unknown) {
+			return false;
+		}
+		pushType(&s, (s.depth != 0) ? s.types[0] : 0);
+		break;
+	case 0x28: /* op_if_eq */
+	case 0x29: /* op_if_neq */
+		if (!popType(&s)) {
+			return false;
+		}
+		/* fall-through */
+	case 0xbc: /* op_iftop_eq */
+	case 0xbd: /* op_iftop_neq */
+		if (!insn->target || !mergeState(v, method, insn->target - v->sob->insns, &s)) {
+			return false;
+		}
+		break;
+	default:
+		if (Insn_GetSize(insn->op, v->gameID) == 0) {
+			return true; /* unimplemented, raises an error when executed */
+		}
+		/* the stack effect is not known, eg. calls and syscalls */
+		resetTypes(&s);
+		if (insn->op == 0xb0 && insn->target && !mergeState(v, method, insn->target - v->sob->insns, &s)) { /* op_gotodefine */
+			return false;
+		}
+		break;
+	}
+	return mergeState(v, method, offset + insn->len, &s);
+}
+
+static bool verifyMethod(Verifier *v, int method, SobCodeEntry *code) {
+	const int32_t locals_size = READ_LE_UINT32(code->locals_ptr);
+	const int32_t args_count = READ_LE_UINT32(code->locals_ptr + 4);
+	if (locals_size < 0 || args_count < 0 || args_count > locals_size || locals_size > 10000) {
+		return false;
+	}
+	v->locals = VM_GetLocalsTemplate(code);
+	v->locals_count = code->locals_count;
+	for (int i = 0; i < v->locals_count; ++i) {
+		if (!isVarType(v->locals[i].type)) {
+			return false;
+		}
+	}
+	StackState s;
+	memset(&s, 0, sizeof(s));
+	v->count = 0;
+	if (!mergeState(v, method, code->code_offset, &s)) {
+		return false;
+	}
+	while (v->count != 0) {
+		const uint32_t offset = v->offsets[--v->count];
+		if (!verifyInsn(v, method, offset)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* unchecked opcode for the instruction, from the state of the method at the
+ * fixpoint, 0 if none */
+static int getUncheckedOp(SobData *sob, const VMInsn *insn, const StackState *s) {
+	if ((insn->num & 0xFFFF0000) != 0) {
+		return 0;
+	}
+	switch (insn->op) {
+	case 0x08: /* op_push_local */
+		return 0xc0; /* op_push_local_unchecked */
+	case 0x0e: /* op_pop_local */
+		if (s->depth != 0) {
+			const int type = VM_GetLocalsTemplate(&sob->codeentries_data[s->method])[insn->num].type;
+			if (s->types[0] == type && isVarType(type)) {
+				return 0xc1; /* op_pop_local_unchecked */
+			}
+		}
+		break;
+	}
+	return 0;
+}
+
+void VM_VerifySob(VMContext *c, SobData *sob) {
+	if (!sob->insns || sob->code_size == 0) {
+		return;
+	}
+	Verifier v;
+	v.gameID = c->gameID;
+	v.sob = sob;
+	v.states = (StackState *)calloc(sob->code_size, sizeof(StackState));
+	v.shared = (uint8_t *)calloc(sob->code_size, 1);
+	v.offsets = (uint32_t *)malloc(sob->code_size * sizeof(uint32_t));
+	v.count = 0;
+	if (!v.states || !v.shared || !v.offsets) {
+		error("Failed to allocate verifier for class '%s'", sob->class_name);
+	}
+	uint8_t *passed = (uint8_t *)calloc(sob->codeentries_count + 1, 1);
+	if (!passed) {
+		error("Failed to allocate verifier for class '%s'", sob->class_name);
+	}
+	int passed_count = 0, methods_count = 0;
+	for (int i = 1; i <= sob->codeentries_count; ++i) {
+		SobCodeEntry *code = &sob->codeentries_data[i];
+		if (code->locals_offset != -1 && code->code_offset < sob->code_size) {
+			++methods_count;
+			if (verifyMethod(&v, i, code)) {
+				passed[i] = 1;
+				++passed_count;
+			}
+		}
+	}
+	int unchecked_count = 0;
+	for (int offset = 0; offset < sob->code_size; ++offset) {
+		const StackState *s = &v.states[offset];
+		if (s->method != 0 && !v.shared[offset] && passed[s->method]) {
+			const int op = getUncheckedOp(sob, &sob->insns[offset], s);
+			if (op != 0) {
+				sob->insns[offset].op = op;
+				++unchecked_count;
+			}
+		}
+	}
+	debug(DBG_VM, "Verified class '%s' methods %d/%d unchecked opcodes %d", sob->class_name, passed_count, methods_count, unchecked_count);
+	free(passed);
+	free(v.offsets);
+	free(v.shared);
+	free(v.states);
+}